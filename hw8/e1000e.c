@@ -19,9 +19,34 @@
 #include <linux/workqueue.h>
 #include <linux/interrupt.h>
 #include <linux/dma-mapping.h>
-
-/* char driver */
-#define DEVCNT 1
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/if_ether.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/atomic.h>
+#include <linux/capability.h>
+#include <linux/delay.h>
+#include <linux/bitmap.h>
+#include <linux/poll.h>
+#include <linux/cache.h>
+#include <linux/kthread.h>
+#include <linux/ethtool.h>
+#include <linux/sysfs.h>
+#include <linux/if_vlan.h>
+
+#include "ece_led.h"
+
+/* char driver, one minor per adapter */
+#define DEVCNT 8
 #define DEV_NAME  "ece_led"
 #define DEV_CLASS "char_class"
 
@@ -32,6 +57,12 @@
 #define DEV_CNTRL_REG        0x00000
 #define DEV_STATUS_REG       0x00008
 #define CNTRL_LINK_UP	     0x1A41
+#define STATUS_LINK_UP       0x02
+
+/* receive address registers, loaded from the eeprom at reset */
+#define RECV_ADDR_LOW        0x05400
+#define RECV_ADDR_HIGH       0x05404
+#define RECV_ADDR_VALID      0x80000000
 
 /* receive packet registers */
 #define RECV_CNTRL_REG       0x00100
@@ -40,20 +71,172 @@
 #define RECV_LEN             0x02808
 #define RECV_HEAD            0x02810
 #define RECV_TAIL	     0x02818
-#define RECV_SETUP           0x821A
+#define RECV_SETUP           0x8202    /* EN | BAM, filtered by address */
+
+/* 
+   rctl filter bits, set from the interface flags and while readers or
+   mmap users hold the ring; the multicast table hashes address bits 47:36
+*/
+#define RCTL_UPE             0x00000008
+#define RCTL_MPE             0x00000010
+#define RECV_MTA             0x05200
+#define MTA_NUM              128
+
+/* 
+   rctl descriptor minimum threshold, RXDMT0 fires once free descriptors
+   drop to 1/2, 1/4 or 1/8 of the ring
+*/
+#define RCTL_RDMTS_MASK      0x00000300
+#define RCTL_RDMTS_SHIFT     8
+
+/* rctl buffer size and long packet bits, BSEX scales BSIZE by 16 */
+#define RCTL_LPE             0x00000020
+#define RCTL_SZ_2048         0x00000000
+#define RCTL_SZ_4096         0x02030000
+#define RCTL_SZ_8192         0x02020000
+#define RCTL_SZ_16384        0x02010000
+
+/* receive checksum offload */
+#define RECV_CSUM            0x05000
+#define RXCSUM_IPOFLD        0x00000100
+#define RXCSUM_TUOFLD        0x00000200
+
+/* transmit packet registers */
+#define XMIT_CNTRL_REG       0x00400
+#define XMIT_IPG             0x00410
+#define XMIT_TDBAL           0x03800
+#define XMIT_TDBAH           0x03804
+#define XMIT_LEN             0x03808
+#define XMIT_HEAD            0x03810
+#define XMIT_TAIL            0x03818
+#define XMIT_SETUP           0x0004010A
+#define XMIT_IPG_SETUP       0x0060200A
 
 /* interrupts */
 #define IMC		     0x000D8
 #define IMS		     0x000D0
 #define ICR		     0x000C0
-#define IRQ_ENABLE           0x10
+#define ICS		     0x000C8
+#define IRQ_TXDW             0x01
+#define IRQ_LSC              0x04
+#define IRQ_RXDMT0           0x10
+#define IRQ_RXO              0x40
+#define IRQ_RXT0             0x80
+
+/* 
+   causes that start the poll, masked while it runs; LSC stays enabled and
+   the rx causes stay masked while a reader busy polls
+*/
+#define IRQ_RX_CAUSES        (IRQ_RXT0 | IRQ_RXDMT0 | IRQ_RXO)
+#define IRQ_CAUSES           (IRQ_RX_CAUSES | IRQ_TXDW)
+#define IRQ_URGENT           (IRQ_RXDMT0 | IRQ_RXO)
+#define IRQ_TEST_LOOPS       16
+
+/* irq to poll delay histogram, bucket n counts delays under 2^n usec */
+#define IRQ_DELAY_BUCKETS    16
+
+/* interrupt moderation */
+#define IRQ_THROTTLE         0x000C4
+#define RECV_DELAY           0x02820
+#define RECV_ABS_DELAY       0x0282C
+#define ITR_ADAPTIVE         1
+#define ITR_MIN              100
+#define ITR_MAX              100000
+#define ITR_LOWEST_LATENCY   70000
+#define ITR_LOW_LATENCY      20000
+#define ITR_BULK             4000
+
+/* ring buffer, depth must be a power of two */
+#define RING_MIN             8
+#define RING_MAX             4096
+#define RING_DEFAULT         256
+
+/* receive descriptor status bits */
+#define RXD_STAT_DD          0x01
+#define RXD_STAT_EOP         0x02
+#define RXD_STAT_IXSM        0x04
+#define RXD_STAT_TCPCS       0x20
+#define RXD_STAT_IPCS        0x40
+
+/* receive descriptor error bits, checksum errors don't make a frame bad */
+#define RXD_ERR_TCPE         0x20
+#define RXD_ERR_IPE          0x40
+#define RXD_ERR_FRAME        0x97
+
+/* transmit descriptor bits */
+#define TXD_CMD_EOP          0x01
+#define TXD_CMD_IFCS         0x02
+#define TXD_CMD_RS           0x08
+#define TXD_STAT_DD          0x01
+
+/* tx buffers for char device writes, skbs are mapped directly */
+#define TX_BUF_LEN           2048
+#define TX_WAKE_THRESH       32
+
+/* 
+   rx buffers: for standard frames each page is split into two halves that
+   take turns on the ring, the hardware writes past some headroom so a half
+   can become an skb; jumbo frames get one whole BSIZE buffer and only their
+   headers are copied, see rx_buf_config()
+*/
+#define RX_HEADROOM          NET_SKB_PAD
+#define RX_SHINFO            SKB_DATA_ALIGN(sizeof(struct skb_shared_info))
+#define RX_HDR_LEN           256
+#define RX_JUMBO_MAX         16128
+
+/* rx poll engine */
+#define POLL_BUDGET          64
+
+/* frames read() picks per trip through ring_lock */
+#define READ_BATCH           16
 
-/* ring buffer */
-#define RING_SIZE 16
+/* 
+   statistics registers, all clear on read; the 64 bit byte counters
+   clear when their high half is read, so read low then high
+*/
+#define STAT_CRCERRS         0x04000
+#define STAT_ALGNERRC        0x04004
+#define STAT_SYMERRS         0x04008
+#define STAT_RXERRC          0x0400C
+#define STAT_MPC             0x04010
+#define STAT_SCC             0x04014
+#define STAT_ECOL            0x04018
+#define STAT_MCC             0x0401C
+#define STAT_LATECOL         0x04020
+#define STAT_COLC            0x04028
+#define STAT_DC              0x04030
+#define STAT_SEC             0x04038
+#define STAT_RLEC            0x04040
+#define STAT_XONRXC          0x04048
+#define STAT_XONTXC          0x0404C
+#define STAT_XOFFRXC         0x04050
+#define STAT_XOFFTXC         0x04054
+#define STAT_FCRUC           0x04058
+#define STAT_GPRC            0x04074
+#define STAT_BPRC            0x04078
+#define STAT_MPRC            0x0407C
+#define STAT_GPTC            0x04080
+#define STAT_GORCL           0x04088
+#define STAT_GOTCL           0x04090
+#define STAT_RNBC            0x040A0
+#define STAT_RUC             0x040A4
+#define STAT_RFC             0x040A8
+#define STAT_ROC             0x040AC
+#define STAT_RJC             0x040B0
+#define STAT_TORL            0x040C0
+#define STAT_TOTL            0x040C8
+#define STAT_TPR             0x040D0
+#define STAT_TPT             0x040D4
+#define STAT_MPTC            0x040F0
+#define STAT_BPTC            0x040F4
+
+/* fold the counters in often enough that the 32 bit ones can't wrap */
+#define HW_STATS_PERIOD      (2 * HZ)
 
 /* descriptor stuff */
 #define E1000_GET_DESC(R, i, type)  (&(((struct type *)((R).dma_mem))[i]))
 #define E1000_RX_DESC(R, i)         E1000_GET_DESC(R, i, rx_desc)
+#define E1000_TX_DESC(R, i)         E1000_GET_DESC(R, i, tx_desc)
 
 /* char device class */
 static struct class *char_class = NULL;
@@ -72,325 +255,3013 @@ static char *driver_name = "my_pci_driver";
 static const struct pci_device_id my_pci_tbl[] = {
 	{ PCI_DEVICE(PCI_VENDOR_ID_INTEL, PCI_DEVICE_82545EM_D), 0, 0, 0},
 
-	/* last entry */
-	{0, }
-};
-MODULE_DEVICE_TABLE(pci, my_pci_tbl);
-MODULE_LICENSE("Dual BSD/GPL");
-MODULE_AUTHOR("Ryan Bornhorst");
+	/* last entry */
+	{0, }
+};
+MODULE_DEVICE_TABLE(pci, my_pci_tbl);
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Ryan Bornhorst");
+
+/* 
+   probed adapters, each owns one char device minor; the list and the
+   minors are protected by adapters_lock
+*/
+static LIST_HEAD(adapters);
+static DEFINE_MUTEX(adapters_lock);
+static DECLARE_BITMAP(minors, DEVCNT);
+
+/* 
+   print packets/poll and polls/sec once a second while traffic flows,
+   off by default since the counters are in ethtool -S
+*/
+static bool poll_report;
+module_param(poll_report, bool, 0644);
+MODULE_PARM_DESC(poll_report, "Report rx poll statistics once a second (default off)");
+
+/* descriptors cleaned before the tail is published in one write */
+static unsigned int rx_refill_thresh = 16;
+module_param(rx_refill_thresh, uint, 0644);
+MODULE_PARM_DESC(rx_refill_thresh, "Descriptors refilled per rx tail write (capped at a quarter of the ring)");
+
+/* frames up to this many bytes are copied so their buffer stays on the ring */
+static unsigned int rx_copybreak = 256;
+module_param(rx_copybreak, uint, 0644);
+MODULE_PARM_DESC(rx_copybreak, "Copy received frames up to this many bytes into a small skb (0 = off)");
+
+/* prefer a dedicated MSI vector over the legacy INTx line */
+static bool use_msi = true;
+module_param(use_msi, bool, 0444);
+MODULE_PARM_DESC(use_msi, "Use MSI interrupts when available (default on)");
+
+/* tx ring depth, fixed at load time */
+static unsigned int tx_ring_size = RING_DEFAULT;
+module_param(tx_ring_size, uint, 0444);
+MODULE_PARM_DESC(tx_ring_size, "Number of tx descriptors (8-4096, rounded up to a power of two)");
+
+/* run the poll from the irq thread instead of softirq after the hard irq */
+static bool threaded_irq;
+module_param(threaded_irq, bool, 0444);
+MODULE_PARM_DESC(threaded_irq, "Poll from a dedicated irq thread that can be pinned and given a realtime priority (default off)");
+
+/* handoff queue stress test run at load time */
+static unsigned int spsc_selftest;
+module_param(spsc_selftest, uint, 0444);
+MODULE_PARM_DESC(spsc_selftest, "Push this many items through the rx handoff queue from two threads at load and report ops/sec (0 = off)");
+
+/* frames queued before the tx tail is published in one write */
+static unsigned int tx_tail_batch = 32;
+module_param(tx_tail_batch, uint, 0644);
+MODULE_PARM_DESC(tx_tail_batch, "Frames queued per tx tail write");
+
+/* interrupt moderation, all three can be changed at runtime through sysfs */
+static unsigned int itr = ITR_ADAPTIVE;
+static unsigned int rx_delay;
+static unsigned int rx_abs_delay;
+static int itr_set(const char *val, const struct kernel_param *kp);
+static int rx_delay_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops itr_ops = {
+	.set = itr_set,
+	.get = param_get_uint,
+};
+module_param_cb(itr, &itr_ops, &itr, 0644);
+MODULE_PARM_DESC(itr, "Interrupts/sec (0 = off, 1 = adaptive, 100-100000 = fixed)");
+
+static const struct kernel_param_ops rx_delay_ops = {
+	.set = rx_delay_set,
+	.get = param_get_uint,
+};
+module_param_cb(rx_delay, &rx_delay_ops, &rx_delay, 0644);
+MODULE_PARM_DESC(rx_delay, "Rx packet timer RDTR in 1.024 usec units (0-65535)");
+module_param_cb(rx_abs_delay, &rx_delay_ops, &rx_abs_delay, 0644);
+MODULE_PARM_DESC(rx_abs_delay, "Rx absolute timer RADV in 1.024 usec units (0-65535)");
+
+/* ring low mark for RXDMT0 as a fraction of the ring, changeable at runtime */
+static unsigned int rx_min_thresh = 8;
+static int rx_min_thresh_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops rx_min_thresh_ops = {
+	.set = rx_min_thresh_set,
+	.get = param_get_uint,
+};
+module_param_cb(rx_min_thresh, &rx_min_thresh_ops, &rx_min_thresh, 0644);
+MODULE_PARM_DESC(rx_min_thresh, "Raise RXDMT0 and refill early when free rx descriptors drop to 1/N of the ring (2, 4 or 8)");
+
+/* rx ring depth, can be changed at runtime through sysfs */
+static unsigned int rx_ring_size = RING_DEFAULT;
+static int rx_ring_size_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops rx_ring_size_ops = {
+	.set = rx_ring_size_set,
+	.get = param_get_uint,
+};
+module_param_cb(rx_ring_size, &rx_ring_size_ops, &rx_ring_size, 0644);
+MODULE_PARM_DESC(rx_ring_size, "Number of rx descriptors (8-4096, rounded up to a power of two)");
+
+/* receive descriptor */
+struct rx_desc {
+	__le64 buffer_addr;
+	union {
+		__le32 data;
+		struct {
+			__le16 length;
+			__le16 css;
+		} flags;
+	} lower;
+	union {
+		__le32 data;
+		struct {
+			__u8 status;
+			__u8 error;
+			__le16 special;
+		} field;
+	} upper;
+};
+
+/* transmit descriptor */
+struct tx_desc {
+	__le64 buffer_addr;
+	union {
+		__le32 data;
+		struct {
+			__le16 length;
+			__u8 cso;
+			__u8 cmd;
+		} flags;
+	} lower;
+	union {
+		__le32 data;
+		struct {
+			__u8 status;
+			__u8 css;
+			__le16 special;
+		} fields;
+	} upper;
+};
+
+/* ring buffer info, the page stays dma mapped for its whole lifetime */
+struct ring_buf {
+	struct page  *page;
+	dma_addr_t   dma_handle;
+	unsigned int page_offset;
+	u64          tstamp;
+};
+
+/* rx poll statistics */
+struct poll_stats {
+	u64                polls;
+	u64                packets;
+	u64                bytes;
+	u64                dd_clears;
+	u64                errors;
+	u64                dropped;
+	u64                alloc_failed;
+	u64                csum_good;
+	u64                csum_errors;
+	u64                copybreak;
+	u64                tail_writes;
+	u64                last_polls;
+	u64                last_packets;
+	u64                last_tail_writes;
+	u64                last_mmio_reads;
+	u64                last_copybreak;
+	u64                last_bytes;
+	unsigned long      last_report;
+};
+
+/* 
+   single producer/single consumer queue: only the producer writes prod
+   and only the consumer writes cons, each on its own cache line and
+   published with release/acquire so neither side takes a lock; both keep
+   a copy of the other's index and only reread it when the copy says the
+   queue is full or empty
+*/
+struct spsc_ring {
+	unsigned int       prod ____cacheline_aligned_in_smp;
+	unsigned int       prod_cons;
+	unsigned int       cons ____cacheline_aligned_in_smp;
+	unsigned int       cons_prod;
+	u32                *slots ____cacheline_aligned_in_smp;
+	unsigned int       mask;
+};
+
+/* 
+   ring data struct; while readers hold the ring the poll hands every
+   completed descriptor index to them through the handoff queue. What the
+   poll touches per descriptor shares the first cache lines, setup and
+   reader state start on a line of their own
+*/
+struct rx_ring {
+	void               *dma_mem ____cacheline_aligned_in_smp;
+	struct ring_buf    *buffer;
+	unsigned int       mask;
+	unsigned int       buf_len;
+	unsigned int       dma_len;
+	unsigned int       buf_offset;
+	unsigned int       page_order;
+	bool               jumbo;
+	uint16_t	   tail;
+	uint16_t           next_to_clean;
+	unsigned int       refill_pending;
+	bool               refill_failed;
+	int                mmap_users;
+	int                readers;
+	struct poll_stats  stats;
+
+	dma_addr_t         dma_handle ____cacheline_aligned_in_smp;
+	size_t             ring_size;
+	unsigned int       count;
+	u32                rctl;
+	unsigned int       gen;
+	wait_queue_head_t  wait;
+	struct spsc_ring   handoff;
+};
+
+/* tx statistics */
+struct tx_stats {
+	u64                packets;
+	u64                bytes;
+	u64                tail_writes;
+	u64                last_packets;
+	u64                last_bytes;
+	unsigned long      last_report;
+};
+
+/* what a tx descriptor points at, skb is NULL for char device frames */
+struct tx_buf {
+	struct sk_buff     *skb;
+	dma_addr_t         dma_handle;
+	unsigned int       len;
+};
+
+/* 
+   transmit ring: the stack and char device writers fill descriptors from
+   next_to_use under xmit_lock, the poll reclaims written back ones from
+   next_to_clean; the two sides run on different cpus so each gets its
+   own cache line, apart from the fields set up once per ring
+*/
+struct tx_ring {
+	void               *dma_mem;
+	dma_addr_t         dma_handle;
+	struct tx_buf      *buffer;
+	u8                 *buf;
+	dma_addr_t         buf_dma;
+	u8                 *staging;
+	size_t             ring_size;
+	unsigned int       count;
+	unsigned int       mask;
+	struct mutex       lock;
+	wait_queue_head_t  wait;
+
+	spinlock_t         xmit_lock ____cacheline_aligned_in_smp;
+	unsigned int       next_to_use;
+	unsigned int       tail_pending;
+	bool               stopped;
+	struct tx_stats    stats;
+
+	unsigned int       next_to_clean ____cacheline_aligned_in_smp;
+	u64                completed;
+};
+
+/* hardware statistics, indexes into hw_stats[] and mydev_s.hw_stats */
+enum {
+	HW_CRCERRS, HW_ALGNERRC, HW_SYMERRS, HW_RXERRC, HW_MPC, HW_SCC,
+	HW_ECOL, HW_MCC, HW_LATECOL, HW_COLC, HW_DC, HW_SEC, HW_RLEC,
+	HW_XONRXC, HW_XONTXC, HW_XOFFRXC, HW_XOFFTXC, HW_FCRUC, HW_GPRC,
+	HW_BPRC, HW_MPRC, HW_GPTC, HW_GORC, HW_GOTC, HW_RNBC, HW_RUC,
+	HW_RFC, HW_ROC, HW_RJC, HW_TOR, HW_TOT, HW_TPR, HW_TPT, HW_MPTC,
+	HW_BPTC,
+	HW_STATS_NUM
+};
+
+/* 
+   per adapter state, allocated in probe; open char device files hold a
+   reference so it outlives dev_remove() until the last one is closed
+*/
+struct mydev_s {
+	struct list_head   list;
+	struct kref        refs;
+	unsigned int       minor;
+	bool               removed;
+	struct pci_dev     *pdev;
+	struct net_device  *netdev;
+	void               *hw_addr;
+	struct napi_struct napi;
+	bool               poll_stopped;
+	unsigned int       itr_current;
+	bool               msi_enabled;
+	bool               irq_test;
+	ktime_t            irq_test_stamp;
+	struct completion  irq_test_done;
+
+	/* when the last interrupt fired, 0 once the poll has picked it up */
+	u64                irq_stamp;
+	u64                irq_delay[IRQ_DELAY_BUCKETS];
+
+	/* set by the irq on overrun or ring low, the poll refills at once */
+	bool               rx_urgent;
+	u64                rx_overruns;
+	u64                rx_starved;
+
+	/* 
+	   readers spinning on the rx ring, see rx_busy_poll(); busy_lock
+	   orders them against poll_stop(), which waits on busy_wait for the
+	   last one to leave
+	*/
+	spinlock_t         busy_lock;
+	int                busy_pollers;
+	wait_queue_head_t  busy_wait;
+
+	/* 
+	   one consumer of the handoff at a time; taken before ring_lock and
+	   never by mmap, so read() can fault on user memory holding it
+	*/
+	struct mutex       read_lock;
+
+	/* 
+	   RCTL is written from ndo_set_rx_mode in atomic context too, so
+	   the receiver state and filter bits have a spinlock of their own
+	*/
+	spinlock_t         rctl_lock;
+	bool               rx_on;
+	u32                rx_mode;
+
+	/* serializes ring (re)allocation against probe and remove */
+	struct mutex       ring_lock;
+	struct rx_ring     rx_ring;
+	struct tx_ring     tx_ring;
+
+	/* clear on read hardware counters folded into 64 bits */
+	struct mutex       stats_lock ____cacheline_aligned_in_smp;
+	struct delayed_work stats_task;
+	u64                hw_stats[HW_STATS_NUM];
+
+	/* 
+	   register reads from the irq, the poll and process context alike,
+	   off the rx lines; the counter block isn't counted
+	*/
+	atomic64_t         mmio_reads;
+};
+
+/* a frame read() has picked, copied out without ring_lock */
+struct rx_frame {
+	struct ece_led_frame hdr;
+	struct page        *page;
+	unsigned int       offset;
+};
+
+/* per open file state */
+struct mydev_file {
+	struct mydev_s     *devs;
+	bool               reader;
+	unsigned int       busy_poll;
+};
+
+/* tracepoints need struct rx_desc */
+#define CREATE_TRACE_POINTS
+#include "e1000e_trace.h"
+
+/******************************************************************************
+
+FUNCTIONS
+
+******************************************************************************/
+
+/* empty the queue, only while neither side is running */
+static void spsc_reset(struct spsc_ring *q) {
+
+	q->prod = q->prod_cons = 0;
+	q->cons = q->cons_prod = 0;
+}
+
+/* set up an empty queue on a numa node, count must be a power of two */
+static int spsc_init(struct spsc_ring *q, unsigned int count, gfp_t gfp,
+		     int node) {
+
+	q->slots = kcalloc_node(count, sizeof(*q->slots), gfp, node);
+	if(!q->slots)
+		return -ENOMEM;
+
+	q->mask = count - 1;
+	spsc_reset(q);
+
+	return 0;
+}
+
+static void spsc_free(struct spsc_ring *q) {
+
+	kfree(q->slots);
+	q->slots = NULL;
+	q->mask = 0;
+	spsc_reset(q);
+}
+
+/* producer: add one entry, false if the queue is full */
+static bool spsc_push(struct spsc_ring *q, u32 val) {
+
+	unsigned int prod = q->prod;
+	unsigned int next = (prod + 1) & q->mask;
+
+	if(next == q->prod_cons) {
+		q->prod_cons = smp_load_acquire(&q->cons);
+		if(next == q->prod_cons)
+			return false;
+	}
+
+	q->slots[prod] = val;
+
+	/* the slot is written before the consumer can see it */
+	smp_store_release(&q->prod, next);
+
+	return true;
+}
+
+/* consumer: number of entries ready to peek at */
+static unsigned int spsc_ready(struct spsc_ring *q) {
+
+	if(q->cons == q->cons_prod)
+		q->cons_prod = smp_load_acquire(&q->prod);
+
+	return (q->cons_prod - q->cons) & q->mask;
+}
+
+/* consumer: the n-th ready entry, n < spsc_ready() */
+static u32 spsc_peek(struct spsc_ring *q, unsigned int n) {
+
+	return q->slots[(q->cons + n) & q->mask];
+}
+
+/* consumer: hand n peeked entries back to the producer */
+static void spsc_release(struct spsc_ring *q, unsigned int n) {
+
+	smp_store_release(&q->cons, (q->cons + n) & q->mask);
+}
+
+/* anyone: true if the consumer has nothing to do, changes no state */
+static bool spsc_empty(struct spsc_ring *q) {
+
+	return smp_load_acquire(&q->prod) == READ_ONCE(q->cons);
+}
+
+/* 
+   register read; each one stalls the cpu for a round trip over pci, so
+   they are counted and kept off the per packet path
+*/
+static u32 mmio_read(struct mydev_s *devs, u32 reg) {
+
+	atomic64_inc(&devs->mmio_reads);
+
+	return readl(devs->hw_addr + reg);
+}
+
+/* print packets/poll and polls/sec for the last reporting interval */
+static void poll_stats_report(struct mydev_s *devs) {
+
+	struct poll_stats *stats = &devs->rx_ring.stats;
+	unsigned long elapsed = jiffies - stats->last_report;
+	u64 polls, packets, tail_writes, mmio_reads, copybreak, bytes;
+	u64 reads    = atomic64_read(&devs->mmio_reads);
+	u64 overruns = READ_ONCE(devs->rx_overruns);
+	u64 starved  = READ_ONCE(devs->rx_starved);
+
+	if(elapsed < HZ)
+		return;
+
+	polls       = stats->polls - stats->last_polls;
+	packets     = stats->packets - stats->last_packets;
+	tail_writes = stats->tail_writes - stats->last_tail_writes;
+	mmio_reads  = reads - stats->last_mmio_reads;
+	copybreak   = stats->copybreak - stats->last_copybreak;
+	bytes       = stats->bytes - stats->last_bytes;
+
+	if(polls)
+		dev_info(&devs->pdev->dev, "rx poll: %llu polls/sec, %llu pkts/poll, %llu bytes/sec, %llu tail writes/1000 pkts, %llu mmio reads/1000 pkts, %llu copied/1000 pkts, %llu errors, %llu ring starved, %llu overruns, %llu no buffers, %llu csum offloaded, %llu csum errors\n",
+			div_u64(polls * HZ, elapsed), div64_u64(packets, polls),
+			div_u64(bytes * HZ, elapsed),
+			packets ? div64_u64(tail_writes * 1000, packets) : 0,
+			packets ? div64_u64(mmio_reads * 1000, packets) : 0,
+			packets ? div64_u64(copybreak * 1000, packets) : 0,
+			stats->errors, starved, overruns,
+			READ_ONCE(devs->hw_stats[HW_RNBC]), stats->csum_good,
+			stats->csum_errors);
+
+	stats->last_polls       = stats->polls;
+	stats->last_packets     = stats->packets;
+	stats->last_tail_writes = stats->tail_writes;
+	stats->last_mmio_reads  = reads;
+	stats->last_copybreak   = stats->copybreak;
+	stats->last_bytes       = stats->bytes;
+	stats->last_report      = jiffies;
+}
+
+/* publish every descriptor recycled so far with a single tail write */
+static void rx_publish_tail(struct mydev_s *devs) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+
+	writel(rxdr->tail, devs->hw_addr + RECV_TAIL);
+	rxdr->stats.tail_writes++;
+	rxdr->refill_pending = 0;
+}
+
+/* rctl RDMTS bits for rx_min_thresh, 1/2 is 0, 1/4 is 1 and 1/8 is 2 */
+static u32 rx_rdmts(void) {
+
+	return (ilog2(rx_min_thresh) - 1) << RCTL_RDMTS_SHIFT;
+}
+
+/* 
+   size the rx buffers for an mtu: standard frames fit a 2048 byte BSIZE
+   with long packets off and share a page in two halves with room for the
+   headroom and build_skb()'s shared info. Jumbo mtus get the smallest
+   BSEX size that holds a whole frame plus LPE, and since the hardware may
+   then fill all of BSIZE each descriptor gets a buffer of exactly that,
+   16K for a 9000 byte mtu; only on a ring the hardware isn't using
+*/
+static void rx_buf_config(struct rx_ring *rxdr, unsigned int mtu) {
+
+	unsigned int frame = mtu + ETH_HLEN + VLAN_HLEN + ETH_FCS_LEN;
+
+	if(mtu <= ETH_DATA_LEN) {
+		rxdr->rctl = RECV_SETUP | RCTL_SZ_2048;
+	} else if(frame <= 4096) {
+		rxdr->rctl = RECV_SETUP | RCTL_LPE | RCTL_SZ_4096;
+		frame = 4096;
+	} else if(frame <= 8192) {
+		rxdr->rctl = RECV_SETUP | RCTL_LPE | RCTL_SZ_8192;
+		frame = 8192;
+	} else {
+		rxdr->rctl = RECV_SETUP | RCTL_LPE | RCTL_SZ_16384;
+		frame = 16384;
+	}
+
+	rxdr->rctl = (rxdr->rctl & ~RCTL_RDMTS_MASK) | rx_rdmts();
+
+	if(mtu <= ETH_DATA_LEN) {
+		rxdr->jumbo      = false;
+		rxdr->buf_offset = RX_HEADROOM;
+		rxdr->buf_len    = roundup_pow_of_two(RX_HEADROOM + frame + RX_SHINFO);
+		rxdr->dma_len    = rxdr->buf_len - RX_HEADROOM - RX_SHINFO;
+		rxdr->page_order = get_order(2 * rxdr->buf_len);
+	} else {
+		rxdr->jumbo      = true;
+		rxdr->buf_offset = 0;
+		rxdr->buf_len    = frame;
+		rxdr->dma_len    = frame;
+		rxdr->page_order = get_order(frame);
+	}
+}
+
+/* bytes of page behind each descriptor, both halves for standard frames */
+static unsigned int rx_page_size(struct rx_ring *rxdr) {
+
+	return PAGE_SIZE << rxdr->page_order;
+}
+
+/* allocate a page for an rx buffer and map it for its whole lifetime */
+static bool rx_alloc_page(struct rx_ring *rxdr, struct device *dev,
+			  struct ring_buf *buffer, gfp_t gfp) {
+
+	buffer->page = alloc_pages_node(dev_to_node(dev),
+					gfp | __GFP_COMP | __GFP_NOWARN,
+					rxdr->page_order);
+	if(!buffer->page)
+		return false;
+
+	buffer->dma_handle = dma_map_page(dev, buffer->page, 0, rx_page_size(rxdr),
+					  DMA_FROM_DEVICE);
+	if(dma_mapping_error(dev, buffer->dma_handle)) {
+		__free_pages(buffer->page, rxdr->page_order);
+		buffer->page = NULL;
+		buffer->dma_handle = 0;
+		return false;
+	}
+
+	buffer->page_offset = 0;
+
+	return true;
+}
+
+/* give the same half back to the hardware */
+static void rx_recycle_buffer(struct rx_ring *rxdr, struct device *dev,
+			      struct ring_buf *buffer) {
+
+	dma_sync_single_range_for_device(dev, buffer->dma_handle,
+					 buffer->page_offset + rxdr->buf_offset,
+					 rxdr->dma_len, DMA_FROM_DEVICE);
+}
+
+/* 
+   turn the current half into an skb without copying, the buffer moves on to
+   the other half of its page, or, while the stack still holds the other
+   half, gives the page up and leaves the slot empty for rx_refill();
+   returns NULL (and leaves the buffer alone) if memory is short
+*/
+static struct sk_buff *rx_build_skb(struct rx_ring *rxdr, struct device *dev,
+				    struct ring_buf *buffer,
+				    struct rx_desc *rx_desc, unsigned int length) {
+
+	struct page *page = buffer->page;
+	struct sk_buff *skb;
+
+	skb = build_skb(page_address(page) + buffer->page_offset, rxdr->buf_len);
+	if(!skb)
+		return NULL;
+
+	skb_reserve(skb, RX_HEADROOM);
+	skb_put(skb, length);
+
+	if(page_ref_count(page) != 1) {
+		/* the skb inherits the ring's reference to the page */
+		dma_unmap_page_attrs(dev, buffer->dma_handle, rx_page_size(rxdr),
+				     DMA_FROM_DEVICE, DMA_ATTR_SKIP_CPU_SYNC);
+		buffer->page = NULL;
+		buffer->dma_handle = 0;
+		return skb;
+	}
+
+	/* the skb keeps this half, the ring takes a new reference */
+	page_ref_inc(page);
+	buffer->page_offset ^= rxdr->buf_len;
+	rx_recycle_buffer(rxdr, dev, buffer);
+
+	rx_desc->buffer_addr = cpu_to_le64(buffer->dma_handle +
+					   buffer->page_offset + rxdr->buf_offset);
+
+	return skb;
+}
+
+/* 
+   copy a small frame into a fresh skb and give the buffer straight back
+   to the hardware, so the half stays hot and nothing pins the page;
+   returns NULL (and leaves the buffer alone) if memory is short
+*/
+static struct sk_buff *rx_copy_skb(struct mydev_s *devs, struct ring_buf *buffer,
+				   unsigned int length) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct sk_buff *skb;
+
+	skb = napi_alloc_skb(&devs->napi, length);
+	if(!skb)
+		return NULL;
+
+	memcpy(skb_put(skb, length), page_address(buffer->page) +
+	       buffer->page_offset + rxdr->buf_offset, length);
+
+	rx_recycle_buffer(rxdr, &devs->pdev->dev, buffer);
+	rxdr->stats.copybreak++;
+
+	return skb;
+}
+
+/* 
+   jumbo frames: copy the headers into a small skb and attach the rest of
+   the buffer as a page fragment, the page goes up with it and the slot is
+   left empty for rx_refill(); returns NULL (and leaves the buffer alone)
+   if memory is short
+*/
+static struct sk_buff *rx_frag_skb(struct mydev_s *devs, struct ring_buf *buffer,
+				   unsigned int length) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct device *dev = &devs->pdev->dev;
+	struct sk_buff *skb;
+
+	if(length <= RX_HDR_LEN)
+		return rx_copy_skb(devs, buffer, length);
+
+	skb = napi_alloc_skb(&devs->napi, RX_HDR_LEN);
+	if(!skb)
+		return NULL;
+
+	memcpy(skb_put(skb, RX_HDR_LEN), page_address(buffer->page), RX_HDR_LEN);
+	skb_add_rx_frag(skb, 0, buffer->page, RX_HDR_LEN, length - RX_HDR_LEN,
+			rx_page_size(rxdr));
+
+	/* the skb inherits the ring's reference to the page */
+	dma_unmap_page_attrs(dev, buffer->dma_handle, rx_page_size(rxdr),
+			     DMA_FROM_DEVICE, DMA_ATTR_SKIP_CPU_SYNC);
+	buffer->page = NULL;
+	buffer->dma_handle = 0;
+
+	return skb;
+}
+
+/* 
+   mark frames whose tcp/udp checksum the hardware verified; on a checksum
+   error the frame goes up unmarked so the stack checks and drops it
+*/
+static void rx_checksum(struct mydev_s *devs, struct sk_buff *skb,
+			u8 status, u8 error) {
+
+	struct poll_stats *stats = &devs->rx_ring.stats;
+
+	skb_checksum_none_assert(skb);
+
+	if(!(devs->netdev->features & NETIF_F_RXCSUM) || (status & RXD_STAT_IXSM))
+		return;
+
+	if(unlikely(error & (RXD_ERR_TCPE | RXD_ERR_IPE))) {
+		stats->csum_errors++;
+		return;
+	}
+
+	if(status & RXD_STAT_TCPCS) {
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+		stats->csum_good++;
+	}
+}
+
+/* 
+   hand the descriptors the poll is done with, tail + 1 up to
+   next_to_clean, back to the hardware: slots whose page went up the stack
+   get a fresh one here, in one batch off the completion path, and the lot
+   is published with a single tail write. Stops at the first allocation
+   that fails and returns false, the poll retries. Held descriptors belong
+   to user space, so nothing is refilled while the ring is held
+*/
+static bool rx_refill(struct mydev_s *devs, gfp_t gfp) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct device *dev = &devs->pdev->dev;
+	struct ring_buf *buffer;
+	uint16_t i, tail = rxdr->tail;
+
+	if(rxdr->mmap_users || rxdr->readers)
+		return true;
+
+	rxdr->refill_failed = false;
+
+	for(i = (tail + 1) & rxdr->mask; i != rxdr->next_to_clean;
+	    i = (i + 1) & rxdr->mask) {
+
+		buffer = &rxdr->buffer[i];
+
+		if(!buffer->page) {
+			if(!rx_alloc_page(rxdr, dev, buffer, gfp)) {
+				rxdr->stats.alloc_failed++;
+				rxdr->refill_failed = true;
+				break;
+			}
+			E1000_RX_DESC(*rxdr, i)->buffer_addr =
+				cpu_to_le64(buffer->dma_handle + rxdr->buf_offset);
+		}
+
+		tail = i;
+	}
+
+	if(tail != rxdr->tail) {
+		rxdr->tail = tail;
+		rx_publish_tail(devs);
+	}
+
+	/* whatever is left waits for the next try */
+	rxdr->refill_pending = (rxdr->next_to_clean - tail - 1) & rxdr->mask;
+
+	return !rxdr->refill_failed;
+}
+
+/* 
+   clean up to budget descriptors that the hardware has written back,
+   returns the number of descriptors cleaned
+*/
+static int rx_poll(struct mydev_s *devs, int budget) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct device *dev = &devs->pdev->dev;
+	struct rx_desc *rx_desc;
+	struct ring_buf *buffer;
+	struct sk_buff *skb;
+	unsigned int thresh;
+	u16 length;
+	u8 status, error;
+	u64 now = 0;
+	int cleaned = 0;
+
+	/* deferred descriptors come out of the ring, so keep most of it live */
+	thresh = clamp_t(unsigned int, rx_refill_thresh, 1, rxdr->count / 4);
+
+	/* the hardware is short of descriptors, hand back every one right away */
+	if(unlikely(READ_ONCE(devs->rx_urgent))) {
+		WRITE_ONCE(devs->rx_urgent, false);
+		if(rxdr->refill_pending)
+			rx_refill(devs, GFP_ATOMIC);
+		thresh = 1;
+	}
+
+	while(cleaned < budget) {
+
+		rx_desc = E1000_RX_DESC(*rxdr, rxdr->next_to_clean);
+		buffer  = &rxdr->buffer[rxdr->next_to_clean];
+
+		/* stop at the first descriptor the hardware still owns */
+		if(!(rx_desc->upper.field.status & RXD_STAT_DD))
+			break;
+
+		/* don't read the rest of the descriptor before DD */
+		dma_rmb();
+
+		length = le16_to_cpu(rx_desc->lower.flags.length);
+		status = rx_desc->upper.field.status;
+		error  = rx_desc->upper.field.error;
+
+		/* let the cpu see the frame */
+		dma_sync_single_range_for_cpu(dev, buffer->dma_handle,
+					      buffer->page_offset + rxdr->buf_offset,
+					      length, DMA_FROM_DEVICE);
+
+		trace_e1000e_rx_desc(rxdr->next_to_clean, rx_desc);
+
+		rxdr->stats.bytes += length;
+		if(unlikely(error & RXD_ERR_FRAME))
+			rxdr->stats.errors++;
+
+		/* user space owns completed descriptors until it hands them back */
+		if(rxdr->mmap_users || rxdr->readers) {
+			if(!now)
+				now = ktime_get_ns();
+			buffer->tstamp = now;
+			if(!rxdr->mmap_users)
+				spsc_push(&rxdr->handoff, rxdr->next_to_clean);
+			WRITE_ONCE(rxdr->next_to_clean,
+				   (rxdr->next_to_clean + 1) & rxdr->mask);
+			cleaned++;
+			continue;
+		}
+
+		/* hand good frames to the stack while the interface is up */
+		skb = NULL;
+		if(netif_running(devs->netdev)) {
+
+			if((status & RXD_STAT_EOP) && !(error & RXD_ERR_FRAME) &&
+			   length > ETH_FCS_LEN) {
+				if(length - ETH_FCS_LEN <= READ_ONCE(rx_copybreak))
+					skb = rx_copy_skb(devs, buffer,
+							  length - ETH_FCS_LEN);
+				else if(rxdr->jumbo)
+					skb = rx_frag_skb(devs, buffer,
+							  length - ETH_FCS_LEN);
+				else
+					skb = rx_build_skb(rxdr, dev, buffer, rx_desc,
+							   length - ETH_FCS_LEN);
+			}
+
+			if(skb) {
+				rx_checksum(devs, skb, status, error);
+				skb->protocol = eth_type_trans(skb, devs->netdev);
+				napi_gro_receive(&devs->napi, skb);
+			} else {
+				rxdr->stats.dropped++;
+				if(!(error & RXD_ERR_FRAME) && (status & RXD_STAT_EOP))
+					rxdr->stats.alloc_failed++;
+			}
+		}
+
+		if(!skb)
+			rx_recycle_buffer(rxdr, dev, buffer);
+
+		/* clear the DD bits */
+		rx_desc->upper.field.status = 0x00;
+		rxdr->stats.dd_clears++;
+
+		rxdr->next_to_clean = (rxdr->next_to_clean + 1) & rxdr->mask;
+
+		/* the descriptor goes back to the hardware with the next refill */
+		if(++rxdr->refill_pending >= thresh)
+			rx_refill(devs, GFP_ATOMIC);
+
+		cleaned++;
+	}
+
+	trace_e1000e_rx_poll(cleaned, budget, rxdr->next_to_clean);
+
+	return cleaned;
+}
+
+/* print tx packets/sec and bytes/sec for the last reporting interval */
+static void tx_stats_report(struct mydev_s *devs) {
+
+	struct tx_stats *stats = &devs->tx_ring.stats;
+	unsigned long elapsed = jiffies - stats->last_report;
+	u64 packets, bytes;
+
+	if(elapsed < HZ)
+		return;
+
+	packets = stats->packets - stats->last_packets;
+	bytes   = stats->bytes - stats->last_bytes;
+
+	if(packets)
+		dev_info(&devs->pdev->dev, "tx: %llu pkts/sec, %llu bytes/sec, %llu tail writes\n",
+			div_u64(packets * HZ, elapsed), div_u64(bytes * HZ, elapsed),
+			stats->tail_writes);
+
+	stats->last_packets = stats->packets;
+	stats->last_bytes   = stats->bytes;
+	stats->last_report  = jiffies;
+}
+
+/* descriptors a writer may still fill */
+static unsigned int tx_unused(struct tx_ring *txr) {
+
+	return (smp_load_acquire(&txr->next_to_clean) - txr->next_to_use - 1) &
+	       txr->mask;
+}
+
+/* publish every queued frame with a single tail write */
+static void tx_publish_tail(struct mydev_s *devs) {
+
+	struct tx_ring *txr = &devs->tx_ring;
+
+	writel(txr->next_to_use, devs->hw_addr + XMIT_TAIL);
+	txr->stats.tail_writes++;
+	txr->tail_pending = 0;
+}
+
+/* queue one frame at next_to_use, caller holds xmit_lock and checked tx_unused() */
+static void tx_queue(struct tx_ring *txr, dma_addr_t dma, unsigned int len,
+		     struct sk_buff *skb) {
+
+	unsigned int i = txr->next_to_use;
+	struct tx_desc *tx_desc = E1000_TX_DESC(*txr, i);
+
+	txr->buffer[i].skb        = skb;
+	txr->buffer[i].dma_handle = dma;
+	txr->buffer[i].len        = len;
+
+	tx_desc->buffer_addr = cpu_to_le64(dma);
+	tx_desc->lower.data  = cpu_to_le32(len |
+			((TXD_CMD_EOP | TXD_CMD_IFCS | TXD_CMD_RS) << 24));
+	tx_desc->upper.data  = 0;
+
+	/* the buffer and the cleared status are written before tx_clean() sees them */
+	smp_store_release(&txr->next_to_use, (i + 1) & txr->mask);
+
+	txr->stats.packets++;
+	txr->stats.bytes += len;
+}
+
+/* 
+   reclaim descriptors the hardware has written back, frees transmitted
+   skbs and wakes blocked writers and the stack's queue
+*/
+static int tx_clean(struct mydev_s *devs) {
+
+	struct tx_ring *txr = &devs->tx_ring;
+	struct device *dev = &devs->pdev->dev;
+	struct tx_desc *tx_desc;
+	struct tx_buf *buffer;
+	unsigned int i = txr->next_to_clean;
+	int cleaned = 0;
+
+	/* pairs with tx_queue(), descriptors before it are fully queued */
+	while(i != smp_load_acquire(&txr->next_to_use)) {
+
+		tx_desc = E1000_TX_DESC(*txr, i);
+
+		if(!(tx_desc->upper.fields.status & TXD_STAT_DD))
+			break;
+
+		/* no stale DD for the next lap round the ring */
+		tx_desc->upper.data = 0;
+
+		buffer = &txr->buffer[i];
+		if(buffer->skb) {
+			dma_unmap_single(dev, buffer->dma_handle, buffer->len,
+					 DMA_TO_DEVICE);
+			dev_consume_skb_any(buffer->skb);
+			buffer->skb = NULL;
+		}
+
+		i = (i + 1) & txr->mask;
+		cleaned++;
+	}
+
+	if(!cleaned)
+		return 0;
+
+	/* the buffers are free once writers see the new next_to_clean */
+	smp_store_release(&txr->next_to_clean, i);
+	txr->completed += cleaned;
+	wake_up_interruptible(&txr->wait);
+
+	/* pairs with the barrier in net_xmit() after stopping the queue */
+	smp_mb();
+	if(netif_queue_stopped(devs->netdev) && netif_running(devs->netdev) &&
+	   tx_unused(txr) >= TX_WAKE_THRESH)
+		netif_wake_queue(devs->netdev);
+
+	return cleaned;
+}
+
+/* program ITR for the given interrupts/sec, 0 turns throttling off */
+static void itr_write(struct mydev_s *devs, unsigned int ints) {
+
+	/* ITR counts in 256 ns increments */
+	writel(ints ? 1000000000 / (ints * 256) : 0, devs->hw_addr + IRQ_THROTTLE);
+}
+
+/* push the moderation parameters to the hardware */
+static void moderation_apply(struct mydev_s *devs) {
+
+	devs->itr_current = (itr == ITR_ADAPTIVE) ? ITR_LOW_LATENCY : itr;
+	itr_write(devs, devs->itr_current);
+
+	writel(rx_delay, devs->hw_addr + RECV_DELAY);
+	writel(rx_abs_delay, devs->hw_addr + RECV_ABS_DELAY);
+}
+
+/* 
+   adaptive mode: pick a throttle from how much work the last poll found,
+   drop the interrupt rate right away under load but raise it gradually
+*/
+static void itr_update(struct mydev_s *devs, int cleaned) {
+
+	unsigned int target;
+
+	if(itr != ITR_ADAPTIVE)
+		return;
+
+	if(cleaned <= 4)
+		target = ITR_LOWEST_LATENCY;
+	else if(cleaned <= 32)
+		target = ITR_LOW_LATENCY;
+	else
+		target = ITR_BULK;
+
+	if(target > devs->itr_current)
+		target = min(devs->itr_current + (target >> 2), target);
+
+	if(target != devs->itr_current) {
+		devs->itr_current = target;
+		itr_write(devs, target);
+	}
+}
+
+/* push new moderation parameters to every adapter, caller holds adapters_lock */
+static void moderation_apply_all(void) {
+
+	struct mydev_s *devs;
+
+	list_for_each_entry(devs, &adapters, list) {
+		mutex_lock(&devs->ring_lock);
+		moderation_apply(devs);
+		mutex_unlock(&devs->ring_lock);
+	}
+}
+
+/* itr parameter store */
+static int itr_set(const char *val, const struct kernel_param *kp) {
+
+	unsigned int ints;
+	int ret;
+
+	ret = kstrtouint(val, 0, &ints);
+	if(ret)
+		return ret;
+
+	if(ints > ITR_ADAPTIVE && (ints < ITR_MIN || ints > ITR_MAX))
+		return -EINVAL;
+
+	mutex_lock(&adapters_lock);
+
+	itr = ints;
+	moderation_apply_all();
+
+	mutex_unlock(&adapters_lock);
+
+	return 0;
+}
+
+/* rx_delay and rx_abs_delay parameter store */
+static int rx_delay_set(const char *val, const struct kernel_param *kp) {
+
+	unsigned int delay;
+	int ret;
+
+	ret = kstrtouint(val, 0, &delay);
+	if(ret)
+		return ret;
+
+	if(delay > 0xFFFF)
+		return -EINVAL;
+
+	mutex_lock(&adapters_lock);
+
+	*(unsigned int *)kp->arg = delay;
+	moderation_apply_all();
+
+	mutex_unlock(&adapters_lock);
+
+	return 0;
+}
+
+/* poll causes to unmask, rx is left to busy pollers while there are any */
+static u32 irq_causes(struct mydev_s *devs) {
+
+	return READ_ONCE(devs->busy_pollers) ? IRQ_CAUSES & ~IRQ_RX_CAUSES :
+					       IRQ_CAUSES;
+}
+
+/* account how long the poll took to start after the interrupt that queued it */
+static void irq_delay_record(struct mydev_s *devs) {
+
+	u64 stamp = READ_ONCE(devs->irq_stamp);
+	u64 usecs;
+
+	if(!stamp)
+		return;
+
+	WRITE_ONCE(devs->irq_stamp, 0);
+	usecs = div_u64(ktime_get_ns() - stamp, NSEC_PER_USEC);
+
+	devs->irq_delay[min_t(unsigned int, usecs ? ilog2(usecs) + 1 : 0,
+			      IRQ_DELAY_BUCKETS - 1)]++;
+}
+
+/* napi poll: budgeted rx poll, interrupts stay masked until the ring drains */
+static int mydev_poll(struct napi_struct *napi, int budget) {
+
+	struct mydev_s *devs = container_of(napi, struct mydev_s, napi);
+	struct rx_ring *rxdr = &devs->rx_ring;
+	int cleaned;
+
+	irq_delay_record(devs);
+
+	tx_clean(devs);
+
+	cleaned = rx_poll(devs, budget);
+
+	rxdr->stats.polls++;
+	rxdr->stats.packets += cleaned;
+
+	/* wake blocked readers and pollers, the barrier pairs with their wait */
+	if(cleaned && wq_has_sleeper(&rxdr->wait))
+		wake_up_interruptible(&rxdr->wait);
+
+	if(poll_report) {
+		poll_stats_report(devs);
+		tx_stats_report(devs);
+	}
+
+	itr_update(devs, cleaned);
+
+	if((rxdr->next_to_clean % 2) == 0) 
+		writel(0x0F0F0F0F, devs->hw_addr + LED_CNTRL_REG);
+	else
+		writel(0x0F0F0E0F, devs->hw_addr + LED_CNTRL_REG);
+
+	/* pages the last refill couldn't get, try again before sleeping */
+	if(unlikely(rxdr->refill_failed))
+		rx_refill(devs, GFP_ATOMIC);
+
+	/* budget used up or the ring still short, napi polls again */
+	if(cleaned == budget || rxdr->refill_failed)
+		return budget;
+
+	/* ring drained, re-enable IRQ */
+	if(napi_complete_done(napi, cleaned))
+		writel(irq_causes(devs), devs->hw_addr + IMS);
+
+	return cleaned;
+}
+
+/* follow the link state in the status register */
+static void link_update(struct mydev_s *devs) {
+
+	if(mmio_read(devs, DEV_STATUS_REG) & STATUS_LINK_UP)
+		netif_carrier_on(devs->netdev);
+	else
+		netif_carrier_off(devs->netdev);
+}
+
+/* 
+   interrupt handler: reading ICR acks every cause, rx and tx causes start
+   the poll (from irq_thread() in threaded mode), overruns and a low ring
+   also make it refill at once, link changes update the carrier here
+*/
+static irqreturn_t irq_handler(int irq, void *data) {
+
+	struct mydev_s *devs = data;
+	uint32_t cause;
+
+	cause = mmio_read(devs, ICR);
+	if(!cause)
+		return IRQ_NONE;
+
+	/* latency self test, see irq_latency_test() */
+	if(READ_ONCE(devs->irq_test)) {
+		devs->irq_test_stamp = ktime_get();
+		complete(&devs->irq_test_done);
+	}
+
+	if((cause & IRQ_LSC) && netif_running(devs->netdev))
+		link_update(devs);
+
+	if(!(cause & IRQ_CAUSES))
+		return IRQ_HANDLED;
+
+	if(cause & IRQ_RXO)
+		WRITE_ONCE(devs->rx_overruns, devs->rx_overruns + 1);
+	if(cause & IRQ_RXDMT0)
+		WRITE_ONCE(devs->rx_starved, devs->rx_starved + 1);
+	if(cause & IRQ_URGENT)
+		WRITE_ONCE(devs->rx_urgent, true);
+
+	WRITE_ONCE(devs->irq_stamp, ktime_get_ns());
+
+	/* led stuff */
+	writel(0x0F0F0F0E, devs->hw_addr + LED_CNTRL_REG);
+
+	/* mask interrupts while we poll */
+	writel(IRQ_CAUSES, devs->hw_addr + IMC);
+
+	/* start the poll */
+	if(threaded_irq)
+		return IRQ_WAKE_THREAD;
+
+	napi_schedule(&devs->napi);
+
+	return IRQ_HANDLED;
+}
+
+/* 
+   threaded mode: schedule napi with bottom halves off, so re-enabling them
+   runs the poll right here in the irq thread rather than in ksoftirqd
+*/
+static irqreturn_t irq_thread(int irq, void *data) {
+
+	struct mydev_s *devs = data;
+
+	local_bh_disable();
+	napi_schedule(&devs->napi);
+	local_bh_enable();
+
+	return IRQ_HANDLED;
+}
+
+/* 
+   raise RXT0 through ICS a few times and time how long it takes the
+   handler to run, reports the interrupt mode that was picked
+*/
+static void irq_latency_test(struct mydev_s *devs) {
+
+	struct pci_dev *pdev = devs->pdev;
+	u64 lat_min = U64_MAX, lat_max = 0, total = 0, delta;
+	ktime_t start;
+	int i, hits = 0;
+
+	init_completion(&devs->irq_test_done);
+
+	for(i = 0; i < IRQ_TEST_LOOPS; i++) {
+
+		reinit_completion(&devs->irq_test_done);
+		WRITE_ONCE(devs->irq_test, true);
+
+		start = ktime_get();
+		writel(IRQ_RXT0, devs->hw_addr + ICS);
+
+		if(!wait_for_completion_timeout(&devs->irq_test_done,
+						msecs_to_jiffies(10))) {
+			WRITE_ONCE(devs->irq_test, false);
+			continue;
+		}
+		WRITE_ONCE(devs->irq_test, false);
+
+		delta = ktime_to_ns(ktime_sub(devs->irq_test_stamp, start));
+		lat_min = min(lat_min, delta);
+		lat_max = max(lat_max, delta);
+		total += delta;
+		hits++;
+	}
+
+	if(!hits) {
+		dev_warn(&pdev->dev, "%s interrupt test: no interrupt seen\n",
+			 devs->msi_enabled ? "MSI" : "legacy INTx");
+		return;
+	}
+
+	dev_info(&pdev->dev, "%s interrupt latency over %d runs: min %llu avg %llu max %llu ns\n",
+		 devs->msi_enabled ? "MSI" : "legacy INTx", hits, lat_min,
+		 div_u64(total, hits), lat_max);
+}
+
+/* unmap and free the receive buffers and the descriptor ring of rxdr */
+static void rx_ring_release(struct mydev_s *devs, struct rx_ring *rxdr) {
+
+	struct pci_dev *pdev = devs->pdev;
+	int i;
+
+	if(rxdr->buffer) {
+	
+		for(i = 0; i < rxdr->count; i++) {
+	
+			if(rxdr->buffer[i].dma_handle) 
+				dma_unmap_page(&pdev->dev,
+					       rxdr->buffer[i].dma_handle,
+					       rx_page_size(rxdr), DMA_FROM_DEVICE);
+	
+			/* pages lent to the stack live on until their skbs are freed */
+			if(rxdr->buffer[i].page)
+				put_page(rxdr->buffer[i].page);
+		}
+
+		kfree(rxdr->buffer);
+		rxdr->buffer = NULL;
+	}
+
+	spsc_free(&rxdr->handoff);
+
+	if(rxdr->dma_mem) {
+
+		dma_free_coherent(&pdev->dev, rxdr->ring_size, rxdr->dma_mem,
+				  rxdr->dma_handle);
+		rxdr->dma_mem = NULL;
+	}
+
+	rxdr->count = 0;
+}
+
+/* unmap and free the receive buffers and the descriptor ring */
+static void ring_free(struct mydev_s *devs) {
+
+	devs->rx_ring.gen++;
+	rx_ring_release(devs, &devs->rx_ring);
+}
+
+/* 
+   allocate count descriptors and a buffer for each, laid out as
+   rx_buf_config() set up rxdr, the buffer pages come from gfp; touches no
+   registers, so rxdr need not be the live ring. count must be a power of
+   two
+*/
+static int rx_ring_alloc(struct mydev_s *devs, struct rx_ring *rxdr,
+			 unsigned int count, gfp_t gfp) {
+
+	struct pci_dev *pdev = devs->pdev;
+	int node = dev_to_node(&pdev->dev);
+	int ret = 0;
+	int i;
+
+	rxdr->count = count;
+	rxdr->mask  = count - 1;
+
+	/* allocate the buffer bookkeeping next to the device */
+	rxdr->buffer = kcalloc_node(count, sizeof(*rxdr->buffer), GFP_KERNEL, node);
+	if(!rxdr->buffer)
+		return -ENOMEM;
+
+	/* held descriptors never exceed the ring, so the handoff can't fill */
+	ret = spsc_init(&rxdr->handoff, count, GFP_KERNEL, node);
+	if(ret)
+		goto err_nomem;
+
+	/* allocate memory for the ring struct */
+	rxdr->ring_size = sizeof(struct rx_desc)*count;
+
+	/* allocate contiguous memory for the descriptor ring */
+	rxdr->dma_mem = dma_zalloc_coherent(&pdev->dev, rxdr->ring_size,
+				 	    &rxdr->dma_handle, GFP_KERNEL);
+
+	if(!rxdr->dma_mem) {
+		ret = -ENOMEM;
+		goto err_nomem;
+	}
+
+	/* setup all the receive buffers: a page each, halved for standard frames */
+	for(i = 0; i < count; i++) {
+				
+		struct rx_desc *rx_desc = E1000_RX_DESC(*rxdr, i);
+		struct ring_buf *buffer = &rxdr->buffer[i];
+		
+		/* the whole page is mapped once for its lifetime */
+		if(!rx_alloc_page(rxdr, &pdev->dev, buffer, gfp)) {
+			ret = -ENOMEM;
+			goto err_nomem;
+		}
+
+		/* store the buffer address */
+		rx_desc->buffer_addr = cpu_to_le64(buffer->dma_handle +
+						   rxdr->buf_offset);
+	}
+
+	return 0;
+
+err_nomem:
+	rx_ring_release(devs, rxdr);
+	return ret;
+}
+
+/* point the hardware at the live ring and hand it every buffer */
+static void ring_program(struct mydev_s *devs) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	uint32_t config;
+
+	/* set up high and low registers */
+	config = (rxdr->dma_handle >> 32) & 0xFFFFFFFF;
+	writel(config, devs->hw_addr + RECV_RDBAH);
+	config = rxdr->dma_handle & 0xFFFFFFFF;
+	writel(config, devs->hw_addr + RECV_RDBAL);
+
+	/* set up head and tail, one descriptor is always left unused */
+	rxdr->next_to_clean = 0;
+	rxdr->tail = rxdr->mask;
+	rxdr->refill_pending = 0;
+	rxdr->refill_failed = false;
+	rxdr->stats.last_report = jiffies;
+	spsc_reset(&rxdr->handoff);
+	rxdr->gen++;
+	writel(0, devs->hw_addr + RECV_HEAD);	
+
+	/* set up receive length register */
+	writel(rxdr->ring_size, devs->hw_addr + RECV_LEN);
+
+	/* hand the buffers to the hardware */
+	writel(rxdr->tail, devs->hw_addr + RECV_TAIL);
+}
+
+/* initialize the descriptor ring for dma, count must be a power of two */
+static int ring_init(struct mydev_s *devs, unsigned int count) {
+
+	int ret;
+
+	ret = rx_ring_alloc(devs, &devs->rx_ring, count, GFP_KERNEL);
+	if(ret)
+		return ret;
+
+	ring_program(devs);
+
+	return 0;
+}
+
+/* 
+   the rx ring is there and so is the hardware behind it; after remove the
+   ring may linger for user space mappings, see ring_vm_close()
+*/
+static bool ring_live(struct mydev_s *devs) {
+
+	return devs->rx_ring.dma_mem && !devs->removed;
+}
+
+/* free the transmit descriptor ring and its buffers */
+static void tx_ring_free(struct mydev_s *devs) {
+
+	struct pci_dev *pdev = devs->pdev;
+	struct tx_ring *txr = &devs->tx_ring;
+	unsigned int i;
+
+	if(txr->buffer) {
+
+		for(i = 0; i < txr->count; i++) {
+
+			if(!txr->buffer[i].skb)
+				continue;
+
+			dma_unmap_single(&pdev->dev, txr->buffer[i].dma_handle,
+					 txr->buffer[i].len, DMA_TO_DEVICE);
+			dev_kfree_skb_any(txr->buffer[i].skb);
+		}
+
+		kfree(txr->buffer);
+		txr->buffer = NULL;
+	}
+
+	kfree(txr->staging);
+	txr->staging = NULL;
+
+	if(txr->buf) {
+		dma_free_coherent(&pdev->dev, txr->count * TX_BUF_LEN, txr->buf,
+				  txr->buf_dma);
+		txr->buf = NULL;
+	}
+
+	if(txr->dma_mem) {
+		dma_free_coherent(&pdev->dev, txr->ring_size, txr->dma_mem,
+				  txr->dma_handle);
+		txr->dma_mem = NULL;
+	}
+}
+
+/* set up the transmit ring, every descriptor gets a fixed dma buffer */
+static int tx_ring_init(struct mydev_s *devs, unsigned int count) {
+
+	struct pci_dev *pdev = devs->pdev;
+	struct tx_ring *txr = &devs->tx_ring;
+	uint32_t config;
+
+	txr->count = count;
+	txr->mask  = count - 1;
+	txr->ring_size = sizeof(struct tx_desc) * count;
+
+	txr->dma_mem = dma_zalloc_coherent(&pdev->dev, txr->ring_size,
+					   &txr->dma_handle, GFP_KERNEL);
+	if(!txr->dma_mem)
+		return -ENOMEM;
+
+	txr->buf = dma_alloc_coherent(&pdev->dev, count * TX_BUF_LEN,
+				      &txr->buf_dma, GFP_KERNEL);
+	txr->buffer  = kcalloc_node(count, sizeof(*txr->buffer), GFP_KERNEL,
+				    dev_to_node(&pdev->dev));
+	txr->staging = kmalloc_node(TX_BUF_LEN, GFP_KERNEL, dev_to_node(&pdev->dev));
+	if(!txr->buf || !txr->buffer || !txr->staging) {
+		tx_ring_free(devs);
+		return -ENOMEM;
+	}
+
+	txr->next_to_use   = 0;
+	txr->next_to_clean = 0;
+	txr->tail_pending  = 0;
+	txr->stopped       = false;
+	txr->stats.last_report = jiffies;
+
+	/* set up high and low registers */
+	config = (txr->dma_handle >> 32) & 0xFFFFFFFF;
+	writel(config, devs->hw_addr + XMIT_TDBAH);
+	config = txr->dma_handle & 0xFFFFFFFF;
+	writel(config, devs->hw_addr + XMIT_TDBAL);
+
+	writel(txr->ring_size, devs->hw_addr + XMIT_LEN);
+	writel(0, devs->hw_addr + XMIT_HEAD);
+	writel(0, devs->hw_addr + XMIT_TAIL);
+
+	/* enable transmit with the default inter packet gap */
+	writel(XMIT_IPG_SETUP, devs->hw_addr + XMIT_IPG);
+	writel(XMIT_SETUP, devs->hw_addr + XMIT_CNTRL_REG);
+
+	return 0;
+}
+
+/* 
+   mask interrupts and wait for a running poll and any busy pollers to
+   finish, nothing looks at the rx ring until poll_start()
+*/
+static void poll_stop(struct mydev_s *devs) {
+
+	bool stopped;
+
+	/* busy pollers see poll_stopped and leave, or never start */
+	spin_lock(&devs->busy_lock);
+	stopped = devs->poll_stopped;
+	WRITE_ONCE(devs->poll_stopped, true);
+	spin_unlock(&devs->busy_lock);
+
+	wait_event(devs->busy_wait, !READ_ONCE(devs->busy_pollers));
+
+	writel(IRQ_CAUSES, devs->hw_addr + IMC);
+	synchronize_irq(devs->pdev->irq);
+
+	if(!stopped)
+		napi_disable(&devs->napi);
+}
+
+/* let interrupts schedule the poll again */
+static void poll_start(struct mydev_s *devs) {
+
+	if(devs->poll_stopped) {
+		napi_enable(&devs->napi);
+		WRITE_ONCE(devs->poll_stopped, false);
+	}
+
+	writel(irq_causes(devs), devs->hw_addr + IMS);
+}
+
+/* 
+   a complete ring with count descriptors and buffers sized for mtu, built
+   off to the side while the live one keeps running, buffer pages come from
+   gfp; NULL if memory is short
+*/
+static struct rx_ring *rx_ring_prepare(struct mydev_s *devs, unsigned int count,
+				       unsigned int mtu, gfp_t gfp) {
+
+	struct rx_ring *fresh;
+
+	fresh = kzalloc_node(sizeof(*fresh), GFP_KERNEL,
+			     dev_to_node(&devs->pdev->dev));
+	if(!fresh)
+		return NULL;
+
+	rx_buf_config(fresh, mtu);
+
+	if(rx_ring_alloc(devs, fresh, count, gfp)) {
+		kfree(fresh);
+		return NULL;
+	}
+
+	return fresh;
+}
+
+/* free a ring from rx_ring_prepare(), or the old one ring_swap() left in it */
+static void rx_ring_destroy(struct mydev_s *devs, struct rx_ring *fresh) {
+
+	rx_ring_release(devs, fresh);
+	kfree(fresh);
+}
+
+/* trade the memory and layout of two rings, the per ring state stays put */
+static void rx_ring_exchange(struct rx_ring *a, struct rx_ring *b) {
+
+	swap(a->dma_mem, b->dma_mem);
+	swap(a->dma_handle, b->dma_handle);
+	swap(a->buffer, b->buffer);
+	swap(a->ring_size, b->ring_size);
+	swap(a->count, b->count);
+	swap(a->mask, b->mask);
+	swap(a->buf_len, b->buf_len);
+	swap(a->dma_len, b->dma_len);
+	swap(a->buf_offset, b->buf_offset);
+	swap(a->page_order, b->page_order);
+	swap(a->jumbo, b->jumbo);
+	swap(a->rctl, b->rctl);
+	swap(a->handoff.slots, b->handoff.slots);
+	swap(a->handoff.mask, b->handoff.mask);
+}
+
+/* 
+   RCTL from the ring's buffer layout and the rx mode, 0 while the receiver
+   is off; held rings see everything for captures. Caller holds rctl_lock
+*/
+static void rctl_write(struct mydev_s *devs) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	u32 rctl = 0;
+
+	if(devs->rx_on) {
+		rctl = rxdr->rctl | devs->rx_mode;
+		if(rxdr->readers || rxdr->mmap_users)
+			rctl |= RCTL_UPE | RCTL_MPE;
+	}
+
+	writel(rctl, devs->hw_addr + RECV_CNTRL_REG);
+}
+
+/* rewrite RCTL after the ring layout or its holders changed */
+static void rctl_update(struct mydev_s *devs) {
+
+	spin_lock_bh(&devs->rctl_lock);
+	rctl_write(devs);
+	spin_unlock_bh(&devs->rctl_lock);
+}
+
+/* turn the receiver on or off */
+static void rx_enable(struct mydev_s *devs, bool on) {
+
+	spin_lock_bh(&devs->rctl_lock);
+	devs->rx_on = on;
+	rctl_write(devs);
+	spin_unlock_bh(&devs->rctl_lock);
+}
+
+/* 
+   after the receiver and/or transmitter were turned off: flush those
+   posted writes and give a dma already under way time to land, like
+   e1000_down() does, before descriptors or buffers are retargeted or freed
+*/
+static void dma_quiesce(struct mydev_s *devs) {
+
+	mmio_read(devs, DEV_STATUS_REG);
+	msleep(10);
+}
+
+/* 
+   put a prepared ring in place of the live one and restart the receiver on
+   it, the old ring is left in fresh for rx_ring_destroy(); the poll must be
+   stopped
+*/
+static void ring_swap(struct mydev_s *devs, struct rx_ring *fresh) {
+
+	rx_enable(devs, false);
+	dma_quiesce(devs);
+
+	rx_ring_exchange(&devs->rx_ring, fresh);
+	ring_program(devs);
+
+	rx_enable(devs, true);
+}
+
+/* 
+   swap the ring for one with count descriptors and buffers sized for mtu;
+   the new ring is built first, so on failure the old one keeps running
+*/
+static int ring_resize(struct mydev_s *devs, unsigned int count,
+		       unsigned int mtu) {
+
+	struct rx_ring *fresh;
+
+	fresh = rx_ring_prepare(devs, count, mtu, GFP_KERNEL);
+	if(!fresh) {
+		dev_err(&devs->pdev->dev, "rx ring resize to %u failed...%d\n",
+			count, -ENOMEM);
+		return -ENOMEM;
+	}
+
+	/* quiesce the poll only for the swap itself */
+	poll_stop(devs);
+	ring_swap(devs, fresh);
+	poll_start(devs);
+
+	rx_ring_destroy(devs, fresh);
+
+	dev_info(&devs->pdev->dev, "rx ring reset with %u descriptors of %u bytes\n",
+		 count, devs->rx_ring.dma_len);
+
+	return 0;
+}
+
+/* completed descriptors user space holds, from tail + 1 up to next_to_clean */
+static unsigned int rx_held(struct rx_ring *rxdr) {
+
+	return (READ_ONCE(rxdr->next_to_clean) - rxdr->tail - 1) & rxdr->mask;
+}
+
+/* 
+   give n descriptors that user space is done with back to the hardware,
+   oldest first, with a single tail write
+*/
+static int ring_return(struct mydev_s *devs, unsigned int n) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct device *dev = &devs->pdev->dev;
+	struct rx_desc *rx_desc;
+	struct ring_buf *buffer;
+	uint16_t i;
+
+	if(n > rx_held(rxdr))
+		return -EINVAL;
+
+	if(!n)
+		return 0;
+
+	while(n--) {
+
+		i = (rxdr->tail + 1) & rxdr->mask;
+
+		rx_desc = E1000_RX_DESC(*rxdr, i);
+		buffer  = &rxdr->buffer[i];
+
+		rx_desc->upper.data = 0;
+		rxdr->stats.dd_clears++;
+		rx_recycle_buffer(rxdr, dev, buffer);
+		rxdr->tail = i;
+	}
+
+	rx_publish_tail(devs);
+
+	return 0;
+}
+
+/* 
+   give back everything user space still holds and empty the handoff,
+   the poll must be stopped; a read() in the middle of copying sees gen
+   move and hands nothing back
+*/
+static void ring_return_all(struct mydev_s *devs) {
+
+	ring_return(devs, rx_held(&devs->rx_ring));
+	spsc_reset(&devs->rx_ring.handoff);
+	devs->rx_ring.gen++;
+}
+
+/* 
+   rx_ring_size parameter store, resizes every live ring or none: all the
+   new rings are built first with every adapter locked, and only swapped
+   in once each one could be had
+*/
+static int rx_ring_size_set(const char *val, const struct kernel_param *kp) {
+
+	struct rx_ring *fresh[DEVCNT] = { NULL };
+	struct mydev_s *devs;
+	unsigned int count, n;
+	int ret;
+
+	ret = kstrtouint(val, 0, &count);
+	if(ret)
+		return ret;
+
+	if(count < RING_MIN || count > RING_MAX)
+		return -EINVAL;
+
+	count = roundup_pow_of_two(count);
+
+	mutex_lock(&adapters_lock);
+
+	n = 0;
+	list_for_each_entry(devs, &adapters, list) {
+
+		/* one lockdep subclass per adapter, at most DEVCNT of them */
+		mutex_lock_nested(&devs->ring_lock, n);
+
+		/* the ring can't move while user space has it mapped */
+		if(!ret && devs->rx_ring.mmap_users)
+			ret = -EBUSY;
+		else if(!ret && count != devs->rx_ring.count) {
+			fresh[n] = rx_ring_prepare(devs, count, devs->netdev->mtu,
+						   GFP_KERNEL);
+			if(!fresh[n]) {
+				dev_err(&devs->pdev->dev,
+					"rx ring resize to %u failed...%d\n",
+					count, -ENOMEM);
+				ret = -ENOMEM;
+			}
+		}
+
+		n++;
+	}
+
+	n = 0;
+	list_for_each_entry(devs, &adapters, list) {
+
+		if(fresh[n]) {
+			if(!ret) {
+				poll_stop(devs);
+				ring_swap(devs, fresh[n]);
+				poll_start(devs);
+				dev_info(&devs->pdev->dev,
+					 "rx ring reset with %u descriptors of %u bytes\n",
+					 count, devs->rx_ring.dma_len);
+			}
+			rx_ring_destroy(devs, fresh[n]);
+		}
+
+		mutex_unlock(&devs->ring_lock);
+		n++;
+	}
+
+	if(!ret)
+		rx_ring_size = count;
+
+	mutex_unlock(&adapters_lock);
+
+	return ret;
+}
+
+/* rx_min_thresh parameter store, takes effect on a running receiver */
+static int rx_min_thresh_set(const char *val, const struct kernel_param *kp) {
+
+	struct mydev_s *devs;
+	struct rx_ring *rxdr;
+	unsigned int frac;
+	int ret;
+
+	ret = kstrtouint(val, 0, &frac);
+	if(ret)
+		return ret;
+
+	if(frac != 2 && frac != 4 && frac != 8)
+		return -EINVAL;
+
+	mutex_lock(&adapters_lock);
+
+	rx_min_thresh = frac;
+
+	list_for_each_entry(devs, &adapters, list) {
+
+		rxdr = &devs->rx_ring;
+
+		mutex_lock(&devs->ring_lock);
+
+		rxdr->rctl = (rxdr->rctl & ~RCTL_RDMTS_MASK) | rx_rdmts();
+		if(ring_live(devs))
+			rctl_update(devs);
+
+		mutex_unlock(&devs->ring_lock);
+	}
+
+	mutex_unlock(&adapters_lock);
+
+	return 0;
+}
+
+/* last reference to a removed adapter is gone */
+static void adapter_release(struct kref *kref) {
+
+	kfree(container_of(kref, struct mydev_s, refs));
+}
+
+/* allows device to be opened using open sys call */
+static int dev_open(struct inode *inode, struct file *file) {
+
+	struct mydev_file *mf;
+	struct mydev_s *devs;
+	int ret = -ENODEV;
+
+    	printk(KERN_INFO "opening char device..\n");
+
+	/* 
+	   a reader sees every frame on the wire and takes them all away from
+	   the stack, as much as a raw socket may, whatever the node's mode
+	*/
+	if((file->f_mode & FMODE_READ) && !capable(CAP_NET_RAW))
+		return -EPERM;
+
+	mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+	if(!mf)
+		return -ENOMEM;
+
+	/* the minor picks the adapter, the file keeps it alive */
+	mutex_lock(&adapters_lock);
+	list_for_each_entry(devs, &adapters, list) {
+		if(devs->minor == iminor(inode)) {
+			kref_get(&devs->refs);
+			mf->devs = devs;
+			file->private_data = mf;
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&adapters_lock);
+
+	if(ret) {
+		kfree(mf);
+		return ret;
+	}
+
+	/* the first reader takes received frames away from the stack */
+	if(file->f_mode & FMODE_READ) {
+		mutex_lock(&devs->ring_lock);
+		if(ring_live(devs)) {
+			poll_stop(devs);
+			/* every held descriptor needs a buffer */
+			if(rx_refill(devs, GFP_KERNEL)) {
+				devs->rx_ring.readers++;
+				mf->reader = true;
+				rctl_update(devs);
+			} else {
+				ret = -ENOMEM;
+			}
+			poll_start(devs);
+		}
+		mutex_unlock(&devs->ring_lock);
+	}
+
+	if(ret) {
+		kref_put(&devs->refs, adapter_release);
+		kfree(mf);
+	}
+
+       	return ret;
+}
+
+/* 
+   spin for up to usecs with rx interrupts masked, watching the DD bit of
+   the next descriptor in coherent memory; once it is set napi runs right
+   here, like irq_thread(), and hands the frames over. Runs without
+   ring_lock: poll_stop() waits for spinners to leave before the ring can
+   change, so the ring stays put while busy_pollers counts us. Returns true
+   if something is ready
+*/
+static bool rx_busy_poll(struct mydev_s *devs, unsigned int usecs) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct rx_desc *rx_desc;
+	u64 end = ktime_get_ns() + (u64)usecs * NSEC_PER_USEC;
+
+	spin_lock(&devs->busy_lock);
+
+	/* the ring is changing hands, or the mmap interface owns it */
+	if(devs->poll_stopped || READ_ONCE(rxdr->mmap_users)) {
+		spin_unlock(&devs->busy_lock);
+		return false;
+	}
+
+	if(!devs->busy_pollers++)
+		writel(IRQ_RX_CAUSES, devs->hw_addr + IMC);
+
+	spin_unlock(&devs->busy_lock);
+
+	while(spsc_empty(&rxdr->handoff)) {
+
+		rx_desc = E1000_RX_DESC(*rxdr, READ_ONCE(rxdr->next_to_clean));
+		if(READ_ONCE(rx_desc->upper.field.status) & RXD_STAT_DD) {
+			local_bh_disable();
+			napi_schedule(&devs->napi);
+			local_bh_enable();
+		}
+
+		if(ktime_get_ns() >= end || signal_pending(current) ||
+		   need_resched() || READ_ONCE(devs->poll_stopped))
+			break;
+
+		cpu_relax();
+	}
+
+	/* the last one out falls back to interrupts, poll_start() does if stopped */
+	spin_lock(&devs->busy_lock);
+	if(!--devs->busy_pollers) {
+		if(!devs->poll_stopped)
+			writel(IRQ_RX_CAUSES, devs->hw_addr + IMS);
+		wake_up(&devs->busy_wait);
+	}
+	spin_unlock(&devs->busy_lock);
+
+	return !spsc_empty(&rxdr->handoff);
+}
+
+/* 
+   copy held frames out to buf, READ_BATCH at a time: they are picked and
+   their pages pinned under ring_lock, copied without it, since a fault on
+   buf takes mmap_sem and mmap() takes ring_lock under mmap_sem, then
+   handed back to the hardware under ring_lock unless the ring was rebuilt
+   meanwhile. Returns the bytes copied, 0 if another reader got there
+   first, EINVAL only if the first frame doesn't fit; caller holds read_lock
+*/
+static ssize_t rx_read_frames(struct mydev_s *devs, char __user *buf,
+			      size_t len) {
+
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct spsc_ring *q = &rxdr->handoff;
+	struct rx_frame batch[READ_BATCH];
+	struct rx_desc *rx_desc;
+	struct ring_buf *buffer;
+	unsigned int ready, gen, n, i, copied;
+	size_t done = 0, want;
+	ssize_t ret = 0;
+	uint16_t idx;
+
+	do {
+		mutex_lock(&devs->ring_lock);
+
+		if(!ring_live(devs))
+			ret = -ENODEV;
+		else if(rxdr->mmap_users)	/* the mmap interface owns them */
+			ret = -EBUSY;
+
+		if(ret) {
+			mutex_unlock(&devs->ring_lock);
+			break;
+		}
+
+		gen   = rxdr->gen;
+		ready = min_t(unsigned int, spsc_ready(q), READ_BATCH);
+		want  = done;
+
+		for(n = 0; n < ready; n++) {
+
+			idx     = spsc_peek(q, n);
+			rx_desc = E1000_RX_DESC(*rxdr, idx);
+			buffer  = &rxdr->buffer[idx];
+
+			memset(&batch[n].hdr, 0, sizeof(batch[n].hdr));
+			batch[n].hdr.len    = le16_to_cpu(rx_desc->lower.flags.length);
+			batch[n].hdr.status = rx_desc->upper.field.status;
+			batch[n].hdr.errors = rx_desc->upper.field.error;
+			batch[n].hdr.index  = idx;
+			batch[n].hdr.tstamp = buffer->tstamp;
+
+			if(want + ECE_LED_FRAME_LEN(batch[n].hdr.len) > len) {
+				if(!want)
+					ret = -EINVAL;
+				break;
+			}
+			want += ECE_LED_FRAME_LEN(batch[n].hdr.len);
+
+			/* a resize may free the ring while the copy runs */
+			batch[n].page   = buffer->page;
+			batch[n].offset = buffer->page_offset + rxdr->buf_offset;
+			get_page(batch[n].page);
+		}
+
+		mutex_unlock(&devs->ring_lock);
+
+		for(copied = 0; copied < n; copied++) {
+
+			if(copy_to_user(buf + done, &batch[copied].hdr,
+					sizeof(batch[copied].hdr)) ||
+			   copy_to_user(buf + done + sizeof(batch[copied].hdr),
+					page_address(batch[copied].page) +
+					batch[copied].offset, batch[copied].hdr.len)) {
+				ret = -EFAULT;
+				break;
+			}
+
+			done += ECE_LED_FRAME_LEN(batch[copied].hdr.len);
+		}
+
+		for(i = 0; i < n; i++)
+			put_page(batch[i].page);
+
+		/* 
+		   everything copied goes back to the hardware in one tail write,
+		   the handoff hands out descriptors in ring order so they are
+		   the oldest
+		*/
+		if(copied) {
+			mutex_lock(&devs->ring_lock);
+			if(ring_live(devs) && rxdr->gen == gen) {
+				spsc_release(q, copied);
+				ring_return(devs, copied);
+			}
+			mutex_unlock(&devs->ring_lock);
+		}
+
+	} while(!ret && copied == READ_BATCH);
+
+	return done ? done : ret;
+}
+
+/* 
+   allows device to be read from using read sys call: copies out as many
+   held frames as fit, each behind a struct ece_led_frame, and gives their
+   descriptors back to the hardware
+*/
+static ssize_t dev_read(struct file *file, char __user *buf, 
+                        size_t len, loff_t *offset) {
+	struct mydev_file *mf = file->private_data;
+	struct mydev_s *devs = mf->devs;
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct spsc_ring *q = &rxdr->handoff;
+	ssize_t ret;
+
+    	if(!buf)
+        	return -EINVAL;
+
+	/* only files counted as readers have frames held for them */
+	if(!mf->reader)
+		return -ENODEV;
+
+	/* another reader may take the frames we woke for, then wait again */
+	do {
+		/* the mmap interface owns the ring, the handoff stays empty */
+		if(READ_ONCE(rxdr->mmap_users))
+			return -EBUSY;
+
+		/* busy poll mode spins a while before falling back to the interrupt */
+		if(mf->busy_poll && spsc_empty(q))
+			rx_busy_poll(devs, mf->busy_poll);
+
+		/* wait for the poll to hand over at least one frame, no lock or mmio */
+		if(spsc_empty(q)) {
+
+			if(file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			if(wait_event_interruptible(rxdr->wait, !spsc_empty(q) ||
+						    READ_ONCE(devs->removed) ||
+						    READ_ONCE(rxdr->mmap_users)))
+				return -ERESTARTSYS;
+		}
+
+		if(mutex_lock_interruptible(&devs->read_lock))
+			return -ERESTARTSYS;
+
+		ret = rx_read_frames(devs, buf, len);
+
+		mutex_unlock(&devs->read_lock);
+
+	} while(!ret);
+
+	return ret;
+}
+
+/* allows device to be written to using write sys call */
+static ssize_t dev_write(struct file *file, const char __user *buf, 
+             		 size_t len, loff_t *offset) {
+
+	struct mydev_file *mf = file->private_data;
+	struct mydev_s *devs = mf->devs;
+	struct tx_ring *txr = &devs->tx_ring;
+	size_t done = 0;
+	ssize_t ret = 0;
+	unsigned int batch;
+	__u16 flen;
+
+    	if(!buf)
+        	return -EINVAL;
+
+	/* raw frames with any source address, as much as a raw socket may */
+	if(!capable(CAP_NET_RAW))
+		return -EPERM;
+
+	/* one writer at a time owns the staging buffer */
+	if(mutex_lock_interruptible(&txr->lock))
+		return -ERESTARTSYS;
+
+	if(!txr->dma_mem) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	batch = max(tx_tail_batch, 1U);
+
+	/* the buffer holds back to back frames, each led by a 16 bit length */
+	while(done + sizeof(flen) <= len) {
+
+		if(copy_from_user(&flen, buf + done, sizeof(flen))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if(flen < ECE_LED_TX_MIN || flen > ECE_LED_TX_MAX ||
+		   done + sizeof(flen) + flen > len) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if(copy_from_user(txr->staging, buf + done + sizeof(flen), flen)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		spin_lock_bh(&txr->xmit_lock);
+
+		/* ring full: send what we have and wait for the poll to reclaim */
+		while(!tx_unused(txr)) {
+
+			if(txr->tail_pending)
+				tx_publish_tail(devs);
+
+			spin_unlock_bh(&txr->xmit_lock);
+
+			if(file->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
+			if(wait_event_interruptible(txr->wait, tx_unused(txr) ||
+						    READ_ONCE(txr->stopped))) {
+				ret = -ERESTARTSYS;
+				goto out;
+			}
+
+			if(READ_ONCE(txr->stopped)) {
+				ret = -ENODEV;
+				goto out;
+			}
+
+			spin_lock_bh(&txr->xmit_lock);
+		}
+
+		memcpy(txr->buf + txr->next_to_use * TX_BUF_LEN, txr->staging, flen);
+		tx_queue(txr, txr->buf_dma + txr->next_to_use * TX_BUF_LEN, flen, NULL);
+
+		if(++txr->tail_pending >= batch)
+			tx_publish_tail(devs);
+
+		spin_unlock_bh(&txr->xmit_lock);
+
+		done += sizeof(flen) + flen;
+	}
+
+	spin_lock_bh(&txr->xmit_lock);
+	if(txr->tail_pending)
+		tx_publish_tail(devs);
+	spin_unlock_bh(&txr->xmit_lock);
+
+out:
+	mutex_unlock(&txr->lock);
+
+	return done ? done : ret;
+}
+
+/* releases the device with the close() sys call */
+static int dev_release(struct inode *inode, struct file *file) {
+
+	struct mydev_file *mf = file->private_data;
+	struct mydev_s *devs = mf->devs;
+	struct rx_ring *rxdr = &devs->rx_ring;
+
+	/* last reader gone: recycle what it held and feed the stack again */
+	if(mf->reader) {
+		mutex_lock(&devs->ring_lock);
+		if(rxdr->readers == 1 && !rxdr->mmap_users && ring_live(devs)) {
+			poll_stop(devs);
+			rxdr->readers--;
+			ring_return_all(devs);
+			rctl_update(devs);
+			poll_start(devs);
+		} else {
+			rxdr->readers--;
+		}
+		mutex_unlock(&devs->ring_lock);
+	}
+
+	kref_put(&devs->refs, adapter_release);
+	kfree(mf);
+
+    	printk(KERN_INFO "device was released...\n");
+    	return 0;
+}
+
+/* readable once new packets arrived, writable while the tx ring has room */
+static __poll_t dev_poll(struct file *file, poll_table *wait) {
+
+	struct mydev_file *mf = file->private_data;
+	struct mydev_s *devs = mf->devs;
+	__poll_t mask = 0;
+
+	poll_wait(file, &devs->rx_ring.wait, wait);
+	poll_wait(file, &devs->tx_ring.wait, wait);
+
+	if(READ_ONCE(devs->removed))
+		return EPOLLERR | EPOLLHUP;
+
+	/* only readers get frames from the handoff */
+	if(mf->reader && !spsc_empty(&devs->rx_ring.handoff))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	if(tx_unused(&devs->tx_ring))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/* 
+   ring ioctls: geometry, handing mmap'd descriptors back and busy polling;
+   user memory is only touched outside ring_lock, since mmap() and munmap()
+   take it under mmap_sem and a fault here takes mmap_sem
+*/
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+
+	struct mydev_file *mf = file->private_data;
+	struct mydev_s *devs = mf->devs;
+	struct rx_ring *rxdr = &devs->rx_ring;
+	struct ece_led_ring_info info;
+	long ret = 0;
+	u32 n = 0;
+
+	if(cmd == ECE_LED_RETURN_DESC || cmd == ECE_LED_SET_BUSY_POLL) {
+		if(get_user(n, (u32 __user *)arg))
+			return -EFAULT;
+	}
+
+	mutex_lock(&devs->ring_lock);
+
+	if(!ring_live(devs)) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	switch(cmd) {
+
+	case ECE_LED_GET_RING_INFO:
+		info.count      = rxdr->count;
+		info.desc_len   = rxdr->ring_size;
+		info.buf_stride = rx_page_size(rxdr);
+		info.buf_len    = rxdr->dma_len;
+		info.buf_offset = rxdr->buf_offset;
+		info.next_desc  = (rxdr->tail + 1) & rxdr->mask;
+		break;
+
+	case ECE_LED_RETURN_DESC:
+		if(!capable(CAP_NET_RAW)) {
+			ret = -EPERM;
+			break;
+		}
+
+		if(!rxdr->mmap_users) {
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = ring_return(devs, n);
+		break;
+
+	case ECE_LED_SET_BUSY_POLL:
+		if(!mf->reader) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if(n > ECE_LED_BUSY_POLL_MAX) {
+			ret = -EINVAL;
+			break;
+		}
+
+		mf->busy_poll = n;
+		break;
+
+	default:
+		ret = -ENOTTY;
+	}
+
+out:
+	mutex_unlock(&devs->ring_lock);
+
+	if(!ret && cmd == ECE_LED_GET_RING_INFO &&
+	   copy_to_user((void __user *)arg, &info, sizeof(info)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/* another vma now shares the ring mapping */
+static void ring_vm_open(struct vm_area_struct *vma) {
+
+	struct mydev_s *devs = vma->vm_private_data;
+
+	mutex_lock(&devs->ring_lock);
+	devs->rx_ring.mmap_users++;
+	mutex_unlock(&devs->ring_lock);
+}
+
+/* last mapping gone: take the ring back and recycle what user space held */
+static void ring_vm_close(struct vm_area_struct *vma) {
+
+	struct mydev_s *devs = vma->vm_private_data;
+	struct rx_ring *rxdr = &devs->rx_ring;
+
+	mutex_lock(&devs->ring_lock);
+
+	/* 
+	   the poll must not see the ring change hands mid run, readers start
+	   over with an empty handoff
+	*/
+	if(rxdr->mmap_users == 1 && devs->removed) {
+		/* dev_remove() left the ring to the last mapping */
+		rxdr->mmap_users--;
+		ring_free(devs);
+		pci_dev_put(devs->pdev);
+	} else if(rxdr->mmap_users == 1 && ring_live(devs)) {
+		poll_stop(devs);
+		rxdr->mmap_users--;
+		ring_return_all(devs);
+		rctl_update(devs);
+		poll_start(devs);
+	} else {
+		rxdr->mmap_users--;
+	}
+
+	mutex_unlock(&devs->ring_lock);
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+	.open  = ring_vm_open,
+	.close = ring_vm_close,
+};
+
+/* map the descriptor ring or the rx buffers read only into user space */
+static int dev_mmap(struct file *file, struct vm_area_struct *vma) {
+
+	struct mydev_file *mf = file->private_data;
+	struct mydev_s *devs = mf->devs;
+	struct rx_ring *rxdr = &devs->rx_ring;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long addr = vma->vm_start;
+	struct rx_ring *fresh = NULL;
+	bool first;
+	int ret = 0;
+	int i, j;
+
+	/* 
+	   the descriptors show dma addresses and a mapping holds every rx
+	   descriptor away from the stack, same privilege as reading
+	*/
+	if(!capable(CAP_NET_RAW))
+		return -EPERM;
+
+	/* the ring is read only for user space */
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	mutex_lock(&devs->ring_lock);
+
+	if(!ring_live(devs)) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if((offset == ECE_LED_MMAP_DESC && size > PAGE_ALIGN(rxdr->ring_size)) ||
+	   (offset == ECE_LED_MMAP_BUFS && size > rxdr->count * rx_page_size(rxdr)) ||
+	   (offset != ECE_LED_MMAP_DESC && offset != ECE_LED_MMAP_BUFS)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* 
+	   first mapping: restart with a fresh ring so every buffer sits at the
+	   start of its page, then stop recycling until user space hands back;
+	   it is built before the poll stops, so failing leaves the old one.
+	   The pages are zeroed, slots the hardware hasn't written yet would
+	   otherwise show user space whatever the kernel left in them
+	*/
+	first = !rxdr->mmap_users;
+	if(first) {
+		fresh = rx_ring_prepare(devs, rxdr->count, devs->netdev->mtu,
+					GFP_KERNEL | __GFP_ZERO);
+		if(!fresh) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		poll_stop(devs);
+		ring_swap(devs, fresh);
+	}
+
+	if(offset == ECE_LED_MMAP_DESC) {
+		vma->vm_pgoff = 0;
+		ret = dma_mmap_coherent(&devs->pdev->dev, vma, rxdr->dma_mem,
+					rxdr->dma_handle, size);
+	} else {
+		for(i = 0; i < rxdr->count && addr < vma->vm_end && !ret; i++)
+			for(j = 0; j < (1 << rxdr->page_order) && addr < vma->vm_end && !ret;
+			    j++, addr += PAGE_SIZE)
+				ret = vm_insert_page(vma, addr, rxdr->buffer[i].page + j);
+	}
+
+	if(!ret) {
+		vma->vm_ops = &ring_vm_ops;
+		vma->vm_private_data = devs;
+		rxdr->mmap_users++;
+
+		/* blocked readers won't see another frame, let them fail with EBUSY */
+		wake_up_interruptible(&rxdr->wait);
+	}
+
+	if(first) {
+		rctl_update(devs);
+		poll_start(devs);
+		rx_ring_destroy(devs, fresh);
+	}
+
+out:
+	mutex_unlock(&devs->ring_lock);
+	return ret;
+}
+
+/* struct for file ops */
+static struct file_operations mydev_fops = {
+    	.owner          = THIS_MODULE,
+    	.open           = dev_open,
+    	.read           = dev_read,
+    	.write          = dev_write,
+    	.poll           = dev_poll,
+    	.unlocked_ioctl = dev_ioctl,
+    	.compat_ioctl   = dev_ioctl,
+    	.mmap           = dev_mmap,
+    	.release        = dev_release,
+};
+
+/* function that allows access to device permissions */
+static char *my_devnode(struct device *dev, umode_t *mode) {
+
+    	if(!mode)
+		return NULL;
+
+    	/* give r/w permission to users */
+    	if(MAJOR(dev -> devt) == MAJOR(mydev.mydev_node))
+        	*mode = 0777;
+
+    	return NULL;
+}	
+
+/* one hardware counter, shown as a file in the hw_stats sysfs group */
+struct hw_stat {
+	struct device_attribute attr;
+	u32                reg;
+	bool               wide;
+};
+
+static ssize_t hw_stat_show(struct device *dev, struct device_attribute *attr,
+			    char *buf);
+
+#define HW_STAT(_idx, _name, _reg, _wide) \
+	[_idx] = { __ATTR(_name, 0444, hw_stat_show, NULL), _reg, _wide }
+
+static struct hw_stat hw_stats[HW_STATS_NUM] = {
+	HW_STAT(HW_CRCERRS,  crc_errors,        STAT_CRCERRS,  false),
+	HW_STAT(HW_ALGNERRC, align_errors,      STAT_ALGNERRC, false),
+	HW_STAT(HW_SYMERRS,  symbol_errors,     STAT_SYMERRS,  false),
+	HW_STAT(HW_RXERRC,   rx_errors,         STAT_RXERRC,   false),
+	HW_STAT(HW_MPC,      missed_packets,    STAT_MPC,      false),
+	HW_STAT(HW_SCC,      single_collisions, STAT_SCC,      false),
+	HW_STAT(HW_ECOL,     excess_collisions, STAT_ECOL,     false),
+	HW_STAT(HW_MCC,      multi_collisions,  STAT_MCC,      false),
+	HW_STAT(HW_LATECOL,  late_collisions,   STAT_LATECOL,  false),
+	HW_STAT(HW_COLC,     collisions,        STAT_COLC,     false),
+	HW_STAT(HW_DC,       defer_count,       STAT_DC,       false),
+	HW_STAT(HW_SEC,      sequence_errors,   STAT_SEC,      false),
+	HW_STAT(HW_RLEC,     rx_length_errors,  STAT_RLEC,     false),
+	HW_STAT(HW_XONRXC,   xon_rx,            STAT_XONRXC,   false),
+	HW_STAT(HW_XONTXC,   xon_tx,            STAT_XONTXC,   false),
+	HW_STAT(HW_XOFFRXC,  xoff_rx,           STAT_XOFFRXC,  false),
+	HW_STAT(HW_XOFFTXC,  xoff_tx,           STAT_XOFFTXC,  false),
+	HW_STAT(HW_FCRUC,    fc_unsupported,    STAT_FCRUC,    false),
+	HW_STAT(HW_GPRC,     good_rx_packets,   STAT_GPRC,     false),
+	HW_STAT(HW_BPRC,     broadcast_rx,      STAT_BPRC,     false),
+	HW_STAT(HW_MPRC,     multicast_rx,      STAT_MPRC,     false),
+	HW_STAT(HW_GPTC,     good_tx_packets,   STAT_GPTC,     false),
+	HW_STAT(HW_GORC,     good_rx_bytes,     STAT_GORCL,    true),
+	HW_STAT(HW_GOTC,     good_tx_bytes,     STAT_GOTCL,    true),
+	HW_STAT(HW_RNBC,     rx_no_buffers,     STAT_RNBC,     false),
+	HW_STAT(HW_RUC,      rx_undersize,      STAT_RUC,      false),
+	HW_STAT(HW_RFC,      rx_fragments,      STAT_RFC,      false),
+	HW_STAT(HW_ROC,      rx_oversize,       STAT_ROC,      false),
+	HW_STAT(HW_RJC,      rx_jabbers,        STAT_RJC,      false),
+	HW_STAT(HW_TOR,      total_rx_bytes,    STAT_TORL,     true),
+	HW_STAT(HW_TOT,      total_tx_bytes,    STAT_TOTL,     true),
+	HW_STAT(HW_TPR,      total_rx_packets,  STAT_TPR,      false),
+	HW_STAT(HW_TPT,      total_tx_packets,  STAT_TPT,      false),
+	HW_STAT(HW_MPTC,     multicast_tx,      STAT_MPTC,     false),
+	HW_STAT(HW_BPTC,     broadcast_tx,      STAT_BPTC,     false),
+};
+
+/* filled in from hw_stats[] at load */
+static struct attribute *hw_stat_attrs[HW_STATS_NUM + 1];
+
+static const struct attribute_group hw_stat_group = {
+	.name  = "hw_stats",
+	.attrs = hw_stat_attrs,
+};
+
+/* one driver counter, a u64 in struct mydev_s listed after the hardware ones */
+struct sw_stat {
+	const char         *name;
+	size_t             offset;
+};
+
+#define SW_STAT(_name, _field) { _name, offsetof(struct mydev_s, _field) }
+
+static const struct sw_stat sw_stats[] = {
+	SW_STAT("rx_polls",          rx_ring.stats.polls),
+	SW_STAT("rx_poll_packets",   rx_ring.stats.packets),
+	SW_STAT("rx_poll_bytes",     rx_ring.stats.bytes),
+	SW_STAT("rx_frame_errors",   rx_ring.stats.errors),
+	SW_STAT("rx_dropped",        rx_ring.stats.dropped),
+	SW_STAT("rx_alloc_failed",   rx_ring.stats.alloc_failed),
+	SW_STAT("rx_copybreak",      rx_ring.stats.copybreak),
+	SW_STAT("rx_dd_clears",      rx_ring.stats.dd_clears),
+	SW_STAT("rx_tail_writes",    rx_ring.stats.tail_writes),
+	SW_STAT("rx_csum_good",      rx_ring.stats.csum_good),
+	SW_STAT("rx_csum_errors",    rx_ring.stats.csum_errors),
+	SW_STAT("rx_ring_starved",   rx_starved),
+	SW_STAT("rx_overruns",       rx_overruns),
+	SW_STAT("tx_packets_queued", tx_ring.stats.packets),
+	SW_STAT("tx_completed",      tx_ring.completed),
+	SW_STAT("tx_tail_writes",    tx_ring.stats.tail_writes),
+	SW_STAT("mmio_reads",        mmio_reads.counter),
+};
+
+#define SW_STATS_NUM ARRAY_SIZE(sw_stats)
+
+/* sysfs: irq to poll delay histogram, one "<usecs> count" line per bucket */
+static ssize_t irq_delay_show(struct device *dev, struct device_attribute *attr,
+			      char *buf) {
+
+	struct mydev_s *devs = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	for(i = 0; i < IRQ_DELAY_BUCKETS; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%lu %llu\n",
+				 i == IRQ_DELAY_BUCKETS - 1 ? ">=" : "<",
+				 i == IRQ_DELAY_BUCKETS - 1 ? 1UL << (i - 1) : 1UL << i,
+				 READ_ONCE(devs->irq_delay[i]));
+
+	return len;
+}
+static DEVICE_ATTR_RO(irq_delay);
+
+/* sysfs: RXDMT0 interrupts, each one the ring running low on descriptors */
+static ssize_t ring_starved_show(struct device *dev,
+				 struct device_attribute *attr, char *buf) {
+
+	struct mydev_s *devs = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(devs->rx_starved));
+}
+static DEVICE_ATTR_RO(ring_starved);
+
+/* sysfs: RXO interrupts, the rx fifo overflowed */
+static ssize_t rx_overruns_show(struct device *dev,
+				struct device_attribute *attr, char *buf) {
 
-/* pci struct */
-struct mydev_s {
-	struct pci_dev     *pdev;
-	void               *hw_addr;
-	struct work_struct service_task;
-};
+	struct mydev_s *devs = dev_get_drvdata(dev);
 
-/* global pci struct variable */
-struct mydev_s *devs;
+	return sprintf(buf, "%llu\n", READ_ONCE(devs->rx_overruns));
+}
+static DEVICE_ATTR_RO(rx_overruns);
 
-/* receive descriptor */
-struct rx_desc {
-	__le64 buffer_addr;
-	union {
-		__le32 data;
-		struct {
-			__le16 length;
-			__le16 css;
-		} flags;
-	} lower;
-	union {
-		__le32 data;
-		struct {
-			__u8 status;
-			__u8 error;
-			__le16 special;
-		} field;
-	} upper;
+static struct attribute *poll_stat_attrs[] = {
+	&dev_attr_irq_delay.attr,
+	&dev_attr_ring_starved.attr,
+	&dev_attr_rx_overruns.attr,
+	NULL
 };
 
-/* ring buffer info */
-struct ring_buf {
-	u8         *data;
-	dma_addr_t dma_handle;
+static const struct attribute_group poll_stat_group = {
+	.attrs = poll_stat_attrs,
 };
 
-/* ring data struct */
-struct rx_ring {
-	void               *dma_mem;
-	dma_addr_t         dma_handle;
-	struct ring_buf    buffer[RING_SIZE];
-	size_t             ring_size;
-	uint16_t	   head;
-	uint16_t	   tail;
-} rx_ring;
+/* every sysfs file under the pci device */
+static const struct attribute_group *mydev_groups[] = {
+	&hw_stat_group,
+	&poll_stat_group,
+	NULL
+};
 
-/******************************************************************************
+/* 
+   read every counter once and add it to the totals, caller holds
+   stats_lock; plain readl(), these reads aren't on any packet's path
+*/
+static void hw_stats_update(struct mydev_s *devs) {
 
-FUNCTIONS
+	u64 val;
+	int i;
 
-******************************************************************************/
+	for(i = 0; i < HW_STATS_NUM; i++) {
 
-/* work thread */
-static void service_task(struct work_struct *worker) {
+		val = readl(devs->hw_addr + hw_stats[i].reg);
+		if(hw_stats[i].wide)
+			val |= (u64)readl(devs->hw_addr + hw_stats[i].reg + 4) << 32;
 
-	struct rx_ring *rx_rings = &rx_ring;
-	struct rx_desc *rx_desc;
-	int prev_head;
+		devs->hw_stats[i] += val;
+	}
+}
 
-	rx_ring.head = readl(devs->hw_addr + RECV_HEAD);
-	rx_ring.tail = readl(devs->hw_addr + RECV_TAIL);
-		
-	msleep(500);
+/* periodic fold so no 32 bit counter saturates between readers */
+static void hw_stats_task(struct work_struct *work) {
 
-	writel(0x0F0F0F0F, devs->hw_addr + LED_CNTRL_REG);
+	struct mydev_s *devs = container_of(to_delayed_work(work), struct mydev_s,
+					    stats_task);
 
-	do {	
+	mutex_lock(&devs->stats_lock);
+	hw_stats_update(devs);
+	mutex_unlock(&devs->stats_lock);
 
-		if(rx_ring.tail >= 15) 
-			writel(0, devs->hw_addr + RECV_TAIL);
-		else 
-			writel((rx_ring.tail + 1), devs->hw_addr + RECV_TAIL);
+	schedule_delayed_work(&devs->stats_task, HW_STATS_PERIOD);
+}
 
-		rx_ring.head = readl(devs->hw_addr + RECV_HEAD);
-		rx_ring.tail = readl(devs->hw_addr + RECV_TAIL);
+/* sysfs: one up to date counter */
+static ssize_t hw_stat_show(struct device *dev, struct device_attribute *attr,
+			    char *buf) {
 
-		/* find the ring position behind head */
-		if(rx_ring.head == 0)
-			prev_head = RING_SIZE - 1;
-		else
-			prev_head = rx_ring.head - 1;
+	struct mydev_s *devs = dev_get_drvdata(dev);
+	struct hw_stat *stat = container_of(attr, struct hw_stat, attr);
+	u64 val;
 
-		/* print out the dma address, dma descriptors, status, and length fields */
-		pr_info("R[desc] [address 63:0]   [vl er S cks ln] [Status] [Length]\n");
-	
-		rx_desc = E1000_RX_DESC(*rx_rings, rx_ring.tail);
-	
-		pr_info("R[0x%02X] %016llX %08x%08x    %02x      %04x \n",
-			rx_ring.tail, le64_to_cpu(rx_desc->buffer_addr),
-			le32_to_cpu(rx_desc->upper.data),
-			le32_to_cpu(rx_desc->lower.data),
-			rx_desc->upper.field.status,
-			rx_desc->lower.flags.length);
-                
-		/* clear the DD bits */
-		if(rx_desc->upper.field.status == 0x03)
-			rx_desc->upper.field.status = 0x00;
-
-		/* print again just to show the DD bits were cleared out */
-		pr_info("R[0x%02X] %016llX %08x%08x    %02x      %04x \n",
-			rx_ring.tail, le64_to_cpu(rx_desc->buffer_addr),
-			le32_to_cpu(rx_desc->upper.data),
-			le32_to_cpu(rx_desc->lower.data),
-			rx_desc->upper.field.status,
-			rx_desc->lower.flags.length);
-
-		if((rx_ring.tail % 2) == 0) 
-			writel(0x0F0F0F0F, devs->hw_addr + LED_CNTRL_REG);
-		else
-			writel(0x0F0F0E0F, devs->hw_addr + LED_CNTRL_REG);
-	
-	/* continue until tail catches up to head */
-	} while(rx_ring.tail != prev_head); 
+	mutex_lock(&devs->stats_lock);
+	hw_stats_update(devs);
+	val = devs->hw_stats[stat - hw_stats];
+	mutex_unlock(&devs->stats_lock);
+
+	return sprintf(buf, "%llu\n", val);
 }
 
-/* interrupt handler */
-static irqreturn_t irq_handler(int irq, void *data) {
+/* ethtool -S: the hardware counters, then the driver's own */
+static int eth_get_sset_count(struct net_device *netdev, int sset) {
 
-	uint32_t interrupt;	
+	return sset == ETH_SS_STATS ? HW_STATS_NUM + SW_STATS_NUM : -EOPNOTSUPP;
+}
 
-	/* led stuff */
-	writel(0x0F0F0F0E, devs->hw_addr + LED_CNTRL_REG);
+static void eth_get_strings(struct net_device *netdev, u32 sset, u8 *data) {
 
-	/* init the work queue */
-	schedule_work(&devs->service_task);
+	int i;
 
-	/* read ICR reg to clear bit */
-	interrupt = readl(devs->hw_addr + ICR);
-		
-	/* re-enable  IRQ */
-	writel(IRQ_ENABLE, devs->hw_addr + IMS);
+	if(sset != ETH_SS_STATS)
+		return;
 
-	return IRQ_HANDLED;
+	for(i = 0; i < HW_STATS_NUM; i++, data += ETH_GSTRING_LEN)
+		strlcpy(data, hw_stats[i].attr.attr.name, ETH_GSTRING_LEN);
+
+	for(i = 0; i < SW_STATS_NUM; i++, data += ETH_GSTRING_LEN)
+		strlcpy(data, sw_stats[i].name, ETH_GSTRING_LEN);
 }
 
-/* initialize the descriptor ring for dma */
-static int ring_init(struct pci_dev *pdev) {
+static void eth_get_ethtool_stats(struct net_device *netdev,
+				  struct ethtool_stats *stats, u64 *data) {
 
-	int ret = 0;
-	uint32_t config;
+	struct mydev_s *devs = *(struct mydev_s **)netdev_priv(netdev);
 	int i;
-	struct rx_ring *rxdr = &rx_ring;
 
-	/* allocate memory for the ring struct */
-	rxdr->ring_size = sizeof(struct rx_desc)*RING_SIZE;
+	mutex_lock(&devs->stats_lock);
+	hw_stats_update(devs);
+	memcpy(data, devs->hw_stats, sizeof(devs->hw_stats));
+	mutex_unlock(&devs->stats_lock);
 
-	/* allocate contiguous memory for 16 descriptor rings */
-	rxdr->dma_mem = dma_zalloc_coherent(&pdev->dev, rxdr->ring_size,
-				 	    &rxdr->dma_handle, GFP_KERNEL);
+	/* updated by the poll without a lock, a snapshot is all ethtool needs */
+	for(i = 0; i < SW_STATS_NUM; i++)
+		data[HW_STATS_NUM + i] =
+			READ_ONCE(*(u64 *)((char *)devs + sw_stats[i].offset));
+}
 
-	if(!rxdr->dma_mem) {
-		ret = -1;
-		goto err_nomem_dma_coherent;
-	}
+static const struct ethtool_ops mydev_ethtool_ops = {
+	.get_link          = ethtool_op_get_link,
+	.get_sset_count    = eth_get_sset_count,
+	.get_strings       = eth_get_strings,
+	.get_ethtool_stats = eth_get_ethtool_stats,
+};
 
-	/* set up high and low registers */
-	config = (rxdr->dma_handle >> 32) & 0xFFFFFFFF;
-	writel(config, devs->hw_addr + RECV_RDBAH);
-	config = rxdr->dma_handle & 0xFFFFFFFF;
-	writel(config, devs->hw_addr + RECV_RDBAL);
+/* the net_device's private area points back at the adapter */
+static struct mydev_s *netdev_adapter(struct net_device *netdev) {
 
-	/* set up head and tail */
-	writel(16, devs->hw_addr + RECV_TAIL);
-	writel(0, devs->hw_addr + RECV_HEAD);	
+	return *(struct mydev_s **)netdev_priv(netdev);
+}
 
-	/* set up receive length register */
-	writel(rxdr->ring_size, devs->hw_addr + RECV_LEN);
-	
-	/* setup all the receive buffers: size = 2048 bytes */
-	for(i = 0; i < RING_SIZE; i++) {
-				
-		struct rx_desc *rx_desc = E1000_RX_DESC(*rxdr, i);
-		u8 *buf;
-		
-		/* allocate buffer for data */
-		buf = kzalloc(2048, GFP_KERNEL);
-		
-		/* set up the data buffer */
-		rxdr->buffer[i].data = buf;
+/* ifconfig up: report the link and let the stack transmit */
+static int net_open(struct net_device *netdev) {
 
-		/* map the buffer address */
-		rxdr->buffer[i].dma_handle = dma_map_single(&pdev->dev, buf, 
-						            2048, DMA_FROM_DEVICE);
+	struct mydev_s *devs = netdev_adapter(netdev);
 
-		if(dma_mapping_error(&pdev->dev, rxdr->buffer[i].dma_handle)) {
-			ret = -1;
-			goto err_nomem_dma_single;
-		}
+	link_update(devs);
 
-		/* store the buffer address */
-		rx_desc->buffer_addr = cpu_to_le64(rxdr->buffer[i].dma_handle);
+	netif_start_queue(netdev);
+
+	return 0;
+}
+
+/* ifconfig down: frames are recycled instead of passed up from now on */
+static int net_stop(struct net_device *netdev) {
+
+	netif_stop_queue(netdev);
+	netif_carrier_off(netdev);
+
+	return 0;
+}
+
+/* map the skb and queue it on the tx ring, the tail is batched with xmit_more */
+static netdev_tx_t net_xmit(struct sk_buff *skb, struct net_device *netdev) {
+
+	struct mydev_s *devs = netdev_adapter(netdev);
+	struct tx_ring *txr = &devs->tx_ring;
+	struct device *dev = &devs->pdev->dev;
+	dma_addr_t dma;
+
+	/* no scatter gather, so the skb is always linear */
+	if(skb_put_padto(skb, ETH_ZLEN))
+		return NETDEV_TX_OK;
+
+	dma = dma_map_single(dev, skb->data, skb->len, DMA_TO_DEVICE);
+	if(dma_mapping_error(dev, dma)) {
+		dev_kfree_skb_any(skb);
+		netdev->stats.tx_dropped++;
+		return NETDEV_TX_OK;
 	}
 
-	return ret;
+	spin_lock(&txr->xmit_lock);
 
-err_nomem_dma_single:
-	for(i = 0; i < RING_SIZE; i++) {
-		dma_unmap_single(&pdev->dev, rxdr->buffer[i].dma_handle, 2048,
-				 DMA_TO_DEVICE);
-		kfree(rxdr->buffer[i].data);
+	if(!tx_unused(txr)) {
+		netif_stop_queue(netdev);
+		spin_unlock(&txr->xmit_lock);
+		dma_unmap_single(dev, dma, skb->len, DMA_TO_DEVICE);
+		return NETDEV_TX_BUSY;
 	}
 
-err_nomem_dma_coherent:
-	dma_free_coherent(&pdev->dev, rxdr->ring_size, rxdr->dma_mem,
-			  rxdr->dma_handle);
-	return ret;
-}
+	tx_queue(txr, dma, skb->len, skb);
 
-/* allows device to be opened using open sys call */
-static int dev_open(struct inode *inode, struct file *file) {
+	/* stop before the ring fills, tx_clean() wakes us back up */
+	if(!tx_unused(txr)) {
+		netif_stop_queue(netdev);
+		smp_mb();
+		if(tx_unused(txr) >= TX_WAKE_THRESH)
+			netif_start_queue(netdev);
+	}
 
-    	printk(KERN_INFO "opening char device..\n");
+	if(!skb->xmit_more || netif_queue_stopped(netdev) ||
+	   ++txr->tail_pending >= max(tx_tail_batch, 1U))
+		tx_publish_tail(devs);
 
-       	return 0;
+	spin_unlock(&txr->xmit_lock);
+
+	return NETDEV_TX_OK;
 }
 
-/* allows device to be read from using read sys call */
-static ssize_t dev_read(struct file *file, char __user *buf, 
-                        size_t len, loff_t *offset) {
-	int ret;
+/* interface counters come straight from the ring statistics */
+static void net_get_stats64(struct net_device *netdev,
+			    struct rtnl_link_stats64 *stats) {
+
+	struct mydev_s *devs = netdev_adapter(netdev);
+
+	stats->rx_packets = devs->rx_ring.stats.packets;
+	stats->rx_bytes   = devs->rx_ring.stats.bytes;
+	stats->rx_errors  = devs->rx_ring.stats.errors;
+	stats->rx_dropped = devs->rx_ring.stats.dropped;
+	stats->tx_packets = devs->tx_ring.stats.packets;
+	stats->tx_bytes   = devs->tx_ring.stats.bytes;
+
+	/* the rest only the hardware counts, as of the last fold */
+	stats->rx_missed_errors = READ_ONCE(devs->hw_stats[HW_MPC]);
+	stats->rx_fifo_errors   = READ_ONCE(devs->hw_stats[HW_RNBC]);
+	stats->rx_over_errors   = READ_ONCE(devs->rx_overruns);
+	stats->rx_crc_errors    = READ_ONCE(devs->hw_stats[HW_CRCERRS]);
+	stats->rx_length_errors = READ_ONCE(devs->hw_stats[HW_RLEC]);
+	stats->multicast        = READ_ONCE(devs->hw_stats[HW_MPRC]);
+	stats->collisions       = READ_ONCE(devs->hw_stats[HW_COLC]);
+	stats->tx_dropped = netdev->stats.tx_dropped;
+}
 
-	uint16_t head, tail;
-	uint32_t config;
+/* 
+   new mtu: rebuild the rx ring with buffers and rctl to match, the old
+   ring and mtu stay if the bigger buffers can't be had
+*/
+static int net_change_mtu(struct net_device *netdev, int new_mtu) {
 
-	head = readl(devs->hw_addr + RECV_HEAD);
-	tail = readl(devs->hw_addr + RECV_TAIL);
+	struct mydev_s *devs = netdev_adapter(netdev);
+	struct rx_ring *rxdr = &devs->rx_ring;
+	int ret;
 
-	/* pack head and tail together */
-	config =   head;
-	config <<= 16;
-	config |=  tail;
+	mutex_lock(&devs->ring_lock);
 
-	printk(KERN_INFO "head/tail = 0x%08x\n", config);
- 
-    	if(*offset >= sizeof(uint32_t))
-        	return 0;
+	/* the buffer layout can't change under user space mappings */
+	if(rxdr->mmap_users) {
+		ret = -EBUSY;
+		goto out;
+	}
 
-    	if(!buf) {
-        	ret = -EINVAL;
-        	goto out;
-    	}
+	ret = ring_resize(devs, rxdr->count, new_mtu);
+	if(ret)
+		goto out;
 
-    	if(copy_to_user(buf, &config, sizeof(uint32_t))) {
-        	ret = -EFAULT;
-        	goto out;
-    	}
-    	ret = sizeof(uint32_t);
-    	*offset += len;
+	netdev->mtu = new_mtu;
 
-    	printk(KERN_INFO "User read from us 0x%08x...\n", config);
- 
 out:
-    return ret;
+	mutex_unlock(&devs->ring_lock);
+	return ret;
 }
 
-/* allows device to be written to using write sys call */
-static ssize_t dev_write(struct file *file, const char __user *buf, 
-             		 size_t len, loff_t *offset) {
+/* ip and tcp/udp checksum offload follow the rxcsum feature flag */
+static void rx_csum_apply(struct mydev_s *devs, netdev_features_t features) {
 
-    	int ret;
-
-    	if(!buf) {
-        	ret = -EINVAL;
-        	goto out;
-    	} 
-      
-    	if(copy_from_user(&ret, buf, len)) {
-        	ret = -EFAULT;
-		printk(KERN_ERR "bad copy from user...\n");
-        	goto out;
-    	}
+	writel((features & NETIF_F_RXCSUM) ? RXCSUM_IPOFLD | RXCSUM_TUOFLD : 0,
+	       devs->hw_addr + RECV_CSUM);
+}
 
-    	ret = len;
-    
-    	printk(KERN_INFO "userspace wrote 0x%08x to us...\n", ret); 
-    
-out:
-    	return ret;
+/* ethtool -K rx on/off */
+static int net_set_features(struct net_device *netdev,
+			    netdev_features_t features) {
+
+	if((netdev->features ^ features) & NETIF_F_RXCSUM)
+		rx_csum_apply(netdev_adapter(netdev), features);
+
+	return 0;
 }
 
-/* releases the device with the close() sys call */
-static int dev_release(struct inode *inode, struct file *file) {
+/* 
+   promiscuous and all multicast follow the interface flags, other
+   multicast groups go through the hardware's hash table
+*/
+static void net_set_rx_mode(struct net_device *netdev) {
 
-    	printk(KERN_INFO "device was released...\n");
-    	return 0;
+	struct mydev_s *devs = netdev_adapter(netdev);
+	struct netdev_hw_addr *ha;
+	u32 mta[MTA_NUM] = { 0 };
+	u32 hash;
+	int i;
+
+	netdev_for_each_mc_addr(ha, netdev) {
+		hash = ((ha->addr[4] >> 4) | ((u32)ha->addr[5] << 4)) & 0xFFF;
+		mta[hash >> 5] |= 1 << (hash & 0x1F);
+	}
+
+	spin_lock_bh(&devs->rctl_lock);
+
+	for(i = 0; i < MTA_NUM; i++)
+		writel(mta[i], devs->hw_addr + RECV_MTA + i * 4);
+
+	devs->rx_mode = 0;
+	if(netdev->flags & IFF_PROMISC)
+		devs->rx_mode |= RCTL_UPE | RCTL_MPE;
+	if(netdev->flags & IFF_ALLMULTI)
+		devs->rx_mode |= RCTL_MPE;
+
+	rctl_write(devs);
+
+	spin_unlock_bh(&devs->rctl_lock);
 }
 
-/* struct for file ops */
-static struct file_operations mydev_fops = {
-    	.owner   = THIS_MODULE,
-    	.open    = dev_open,
-    	.read    = dev_read,
-    	.write   = dev_write,
-    	.release = dev_release,
+static const struct net_device_ops mydev_netdev_ops = {
+	.ndo_open            = net_open,
+	.ndo_stop            = net_stop,
+	.ndo_start_xmit      = net_xmit,
+	.ndo_get_stats64     = net_get_stats64,
+	.ndo_set_features    = net_set_features,
+	.ndo_set_rx_mode     = net_set_rx_mode,
+	.ndo_change_mtu      = net_change_mtu,
+	.ndo_validate_addr   = eth_validate_addr,
 };
 
-/* function that allows access to device permissions */
-static char *my_devnode(struct device *dev, umode_t *mode) {
+/* read the mac address the eeprom loaded into receive address 0 */
+static void mac_init(struct mydev_s *devs) {
 
-    	if(!mode)
-		return NULL;
+	struct net_device *netdev = devs->netdev;
+	u32 low  = mmio_read(devs, RECV_ADDR_LOW);
+	u32 high = mmio_read(devs, RECV_ADDR_HIGH);
+	u8 addr[ETH_ALEN];
 
-    	/* give r/w permission to users */
-    	if(dev -> devt == mydev.mydev_node)
-        	*mode = 0777;
+	addr[0] = low;
+	addr[1] = low >> 8;
+	addr[2] = low >> 16;
+	addr[3] = low >> 24;
+	addr[4] = high;
+	addr[5] = high >> 8;
 
-    	return NULL;
-}	
+	if((high & RECV_ADDR_VALID) && is_valid_ether_addr(addr)) {
+		memcpy(netdev->dev_addr, addr, ETH_ALEN);
+		return;
+	}
+
+	eth_hw_addr_random(netdev);
+	dev_warn(&devs->pdev->dev, "no valid mac address, using %pM\n",
+		 netdev->dev_addr);
+}
 
 /* pci probe function */
 static int dev_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
 
+	struct mydev_s *devs;
+	struct net_device *netdev;
+	struct device *node;
 	uint32_t ioremap_len;
 	int err;
 
@@ -413,14 +3284,37 @@ static int dev_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
 
 	pci_set_master(pdev);
 
-	devs = kzalloc(sizeof(*devs), GFP_KERNEL);
+	/* per adapter state, every ring, lock and counter lives in here */
+	devs = kzalloc_node(sizeof(*devs), GFP_KERNEL, dev_to_node(&pdev->dev));
 	if(!devs) {
 		err = -ENOMEM;
 		goto err_dev_alloc;
 	}
+	kref_init(&devs->refs);
+	mutex_init(&devs->read_lock);
+	mutex_init(&devs->ring_lock);
+	mutex_init(&devs->stats_lock);
+	spin_lock_init(&devs->busy_lock);
+	spin_lock_init(&devs->rctl_lock);
+	init_waitqueue_head(&devs->busy_wait);
+	INIT_DELAYED_WORK(&devs->stats_task, hw_stats_task);
+	spin_lock_init(&devs->tx_ring.xmit_lock);
+	mutex_init(&devs->tx_ring.lock);
+	init_waitqueue_head(&devs->tx_ring.wait);
+	init_waitqueue_head(&devs->rx_ring.wait);
 	devs->pdev = pdev;
 	pci_set_drvdata(pdev, devs);
 
+	/* the net_device's private area only holds a pointer back to devs */
+	netdev = alloc_etherdev(sizeof(devs));
+	if(!netdev) {
+		err = -ENOMEM;
+		goto err_netdev_alloc;
+	}
+	SET_NETDEV_DEV(netdev, &pdev->dev);
+	*(struct mydev_s **)netdev_priv(netdev) = devs;
+	devs->netdev = netdev;
+
 	ioremap_len = pci_resource_len(pdev, 0);
 	devs->hw_addr = ioremap(pci_resource_start(pdev, 0), ioremap_len);
 	if(!devs->hw_addr) {
@@ -439,28 +3333,168 @@ static int dev_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
 	writel(CNTRL_LINK_UP, devs->hw_addr + DEV_CNTRL_REG);
 
 	/* set interrupts in IMS */
-	writel(IRQ_ENABLE, devs->hw_addr + IMS);
+	writel(IRQ_CAUSES | IRQ_LSC, devs->hw_addr + IMS);
+
+	mac_init(devs);
+
+	/* whatever the counters held before the reset isn't ours */
+	hw_stats_update(devs);
+	memset(devs->hw_stats, 0, sizeof(devs->hw_stats));
+
+	/* start the napi poll */
+	netif_napi_add(netdev, &devs->napi, mydev_poll, POLL_BUDGET);
+	napi_enable(&devs->napi);
+
+	/* setup the receive ring, standard frames until the mtu changes */
+	netdev->max_mtu = RX_JUMBO_MAX - (ETH_HLEN + ETH_FCS_LEN);
+	mutex_lock(&devs->ring_lock);
+	rx_buf_config(&devs->rx_ring, netdev->mtu);
+	err = ring_init(devs, rx_ring_size);
+	mutex_unlock(&devs->ring_lock);
+	if(err) {
+		dev_err(&pdev->dev, "rx ring setup failed...%d\n", err);
+		goto err_ring;
+	}
+
+	/* setup the transmit ring */
+	mutex_lock(&devs->tx_ring.lock);
+	err = tx_ring_init(devs, roundup_pow_of_two(clamp_t(unsigned int, tx_ring_size,
+							    RING_MIN, RING_MAX)));
+	mutex_unlock(&devs->tx_ring.lock);
+	if(err) {
+		dev_err(&pdev->dev, "tx ring setup failed...%d\n", err);
+		goto err_tx;
+	}
 
-	/* setup the receive ring */
-	ring_init(pdev);
+	/* setup interrupt moderation */
+	mutex_lock(&devs->ring_lock);
+	moderation_apply(devs);
+	mutex_unlock(&devs->ring_lock);
+
+	/* checksum offload is on by default, before the receiver starts */
+	netdev->hw_features = NETIF_F_RXCSUM;
+	netdev->features |= NETIF_F_RXCSUM;
+	rx_csum_apply(devs, netdev->features);
 
 	/* setup receive cntrl reg */
-	writel(RECV_SETUP, devs->hw_addr + RECV_CNTRL_REG);
+	rx_enable(devs, true);
+
+	/* setup IRQ, MSI gives us a vector nobody else shares */
+	if(use_msi && !pci_enable_msi(pdev))
+		devs->msi_enabled = true;
+	else
+		dev_info(&pdev->dev, "MSI unavailable, using legacy INTx\n");
+
+	/* 
+	   legacy INTx is usually shared, the handler returns IRQ_NONE when ICR
+	   shows nothing of ours
+	*/
+	err = request_threaded_irq(pdev->irq, irq_handler,
+				   threaded_irq ? irq_thread : NULL,
+				   (devs->msi_enabled ? 0 : IRQF_SHARED) |
+				   (threaded_irq ? IRQF_ONESHOT : 0),
+				   "e1000e_irq", devs);
+	if(err) {
+		dev_err(&pdev->dev, "request_irq failed...%d\n", err);
+		goto err_irq;
+	}
+
+	irq_latency_test(devs);
+
+	/* hook up to the network stack */
+	netdev->netdev_ops = &mydev_netdev_ops;
+	netdev->ethtool_ops = &mydev_ethtool_ops;
+	netif_carrier_off(netdev);
+
+	err = register_netdev(netdev);
+	if(err) {
+		dev_err(&pdev->dev, "register_netdev failed...%d\n", err);
+		goto err_netdev;
+	}
+
+	/* hardware counters under hw_stats, the irq delay histogram beside them */
+	err = sysfs_create_groups(&pdev->dev.kobj, mydev_groups);
+	if(err) {
+		dev_err(&pdev->dev, "sysfs groups failed...%d\n", err);
+		goto err_sysfs;
+	}
+	schedule_delayed_work(&devs->stats_task, HW_STATS_PERIOD);
+
+	/* claim a char device minor, the first adapter keeps the old name */
+	mutex_lock(&adapters_lock);
+
+	devs->minor = find_first_zero_bit(minors, DEVCNT);
+	if(devs->minor >= DEVCNT) {
+		mutex_unlock(&adapters_lock);
+		dev_err(&pdev->dev, "no free char device minor, %d adapters max\n",
+			DEVCNT);
+		err = -ENOSPC;
+		goto err_minor;
+	}
+
+	node = device_create(char_class, &pdev->dev,
+			     MKDEV(MAJOR(mydev.mydev_node), devs->minor), NULL,
+			     devs->minor ? DEV_NAME "%u" : DEV_NAME, devs->minor);
+	if(IS_ERR(node)) {
+		mutex_unlock(&adapters_lock);
+		err = PTR_ERR(node);
+		dev_err(&pdev->dev, "failed to create device...%d\n", err);
+		goto err_minor;
+	}
 
-	/* start work queue thread */
-	INIT_WORK(&devs->service_task, service_task); 
+	set_bit(devs->minor, minors);
+	list_add_tail(&devs->list, &adapters);
 
-	/* setup IRQ */
-	err = request_irq(pdev->irq, irq_handler, 0, "e1000e_irq", devs);
+	mutex_unlock(&adapters_lock);
+
+	dev_info(&pdev->dev, "%s: %pM, %s\n", netdev->name, netdev->dev_addr,
+		 dev_name(node));
 
 	/* turn off all leds to start except 2 */
 	writel(0x0F0E0F0F, devs->hw_addr + LED_CNTRL_REG);
 	
 	return 0;
 
-err_dev_alloc:
-	kfree(devs);
+err_minor:
+	cancel_delayed_work_sync(&devs->stats_task);
+	sysfs_remove_groups(&pdev->dev.kobj, mydev_groups);
+err_sysfs:
+	unregister_netdev(netdev);
+err_netdev:
+	writel(0xFFFFFFFF, devs->hw_addr + IMC);
+	free_irq(pdev->irq, devs);
+err_irq:
+	if(devs->msi_enabled)
+		pci_disable_msi(pdev);
+	writel(0xFFFFFFFF, devs->hw_addr + IMC);
+	writel(0, devs->hw_addr + XMIT_CNTRL_REG);
+	dma_quiesce(devs);
+
+	/* 
+	   a poll that is already scheduled must be done with the rings before
+	   they go; poll_stop() only stops it once, so each label that can be
+	   jumped to directly calls it again
+	*/
+	poll_stop(devs);
+	mutex_lock(&devs->tx_ring.lock);
+	tx_ring_free(devs);
+	mutex_unlock(&devs->tx_ring.lock);
+err_tx:
+	rx_enable(devs, false);
+	dma_quiesce(devs);
+	poll_stop(devs);
+	mutex_lock(&devs->ring_lock);
+	ring_free(devs);
+	mutex_unlock(&devs->ring_lock);
+err_ring:
+	poll_stop(devs);
+	netif_napi_del(&devs->napi);
+	iounmap(devs->hw_addr);
 err_io_remap:
+	free_netdev(netdev);
+err_netdev_alloc:
+	kfree(devs);
+err_dev_alloc:
 	pci_release_selected_regions(pdev, pci_select_bars(pdev, IORESOURCE_MEM));
 err_pci_reg:
 err_dma:
@@ -471,43 +3505,76 @@ err_dma:
 /* removes pci device during unbind or rmmod */
 static void dev_remove(struct pci_dev *pdev) {
 
-	int i;
-	struct rx_ring *rxdr = &rx_ring;
+	struct mydev_s *devs = pci_get_drvdata(pdev);
+	struct net_device *netdev = devs->netdev;
 
-	cancel_work_sync(&devs->service_task);
+	/* no new opens, files that are already open see the rings go away */
+	mutex_lock(&adapters_lock);
+	list_del(&devs->list);
+	device_destroy(char_class, MKDEV(MAJOR(mydev.mydev_node), devs->minor));
+	clear_bit(devs->minor, minors);
+	mutex_unlock(&adapters_lock);
 
-	free_irq(pdev->irq, devs);
+	/* stop the counters before the registers go away */
+	sysfs_remove_groups(&pdev->dev.kobj, mydev_groups);
+	cancel_delayed_work_sync(&devs->stats_task);
 
-	if(rxdr->dma_mem && rxdr->buffer) {
-	
-		for(i = 0; i < RING_SIZE; i++) {
-	
-			if(rxdr->buffer[i].dma_handle) 
-				dma_unmap_single(&pdev->dev,
-					         rxdr->buffer[i].dma_handle,
-						 2048, DMA_FROM_DEVICE);
-	
-			kfree(rxdr->buffer[i].data);
-		}
-	}
+	/* stop the stack first, this calls net_stop() */
+	unregister_netdev(netdev);
 
-	if(rxdr->dma_mem) {
+	mutex_lock(&devs->ring_lock);
 
-		dma_free_coherent(&pdev->dev, rxdr->ring_size, rxdr->dma_mem,
-				  rxdr->dma_handle);
-		rxdr->dma_mem = NULL;
-	}
+	/* mask interrupts so the poll can't re-arm them */
+	writel(0xFFFFFFFF, devs->hw_addr + IMC);
 
-	devs = pci_get_drvdata(pdev);
+	free_irq(pdev->irq, devs);
+	if(devs->msi_enabled)
+		pci_disable_msi(pdev);
+
+	poll_stop(devs);
+	netif_napi_del(&devs->napi);
+	writel(0xFFFFFFFF, devs->hw_addr + IMC);
+
+	/* stop the receiver and transmitter before their buffers go away */
+	rx_enable(devs, false);
+	writel(0, devs->hw_addr + XMIT_CNTRL_REG);
+	dma_quiesce(devs);
+
+	/* 
+	   user space mappings still show the descriptors and buffers, so the
+	   last one to go frees the ring, see ring_vm_close(); the pci device
+	   has to stay around for the dma api until then
+	*/
+	if(devs->rx_ring.mmap_users)
+		pci_dev_get(pdev);
+	else
+		ring_free(devs);
+
+	/* kick readers and writers waiting on a ring that is gone */
+	WRITE_ONCE(devs->removed, true);
+	wake_up_interruptible(&devs->rx_ring.wait);
+	WRITE_ONCE(devs->tx_ring.stopped, true);
+	wake_up_interruptible(&devs->tx_ring.wait);
+
+	mutex_lock(&devs->tx_ring.lock);
+	tx_ring_free(devs);
+	mutex_unlock(&devs->tx_ring.lock);
 
 	dev_info(&pdev->dev, "removing pci device...\n");
    
 	iounmap(devs->hw_addr);
+	devs->hw_addr = NULL;
 
-	kfree(devs);
+	mutex_unlock(&devs->ring_lock);
+
+	free_netdev(netdev);
+	devs->netdev = NULL;
 
 	pci_release_selected_regions(pdev, pci_select_bars(pdev, IORESOURCE_MEM));
 	pci_disable_device(pdev);
+
+	/* open char device files may still hold the adapter */
+	kref_put(&devs->refs, adapter_release);
 }
 
 /* struct for the pci device */
@@ -518,17 +3585,129 @@ static struct pci_driver my_driver = {
 	.remove   = dev_remove,
 };
 
+/* handoff stress test state shared by the two threads */
+struct spsc_test {
+	struct spsc_ring   q;
+	unsigned int       ops;
+	unsigned int       errors;
+	struct completion  done;
+};
+
+/* push 0..ops-1, spinning while the queue is full */
+static int spsc_test_producer(void *data) {
+
+	struct spsc_test *t = data;
+	unsigned int i;
+
+	for(i = 0; i < t->ops; i++) {
+		while(!spsc_push(&t->q, i)) {
+			cpu_relax();
+			cond_resched();
+		}
+	}
+
+	complete(&t->done);
+	return 0;
+}
+
+/* pop in batches and check every value arrives once and in order */
+static int spsc_test_consumer(void *data) {
+
+	struct spsc_test *t = data;
+	unsigned int i = 0, n, j;
+
+	while(i < t->ops) {
+
+		n = spsc_ready(&t->q);
+		if(!n) {
+			cpu_relax();
+			cond_resched();
+			continue;
+		}
+
+		for(j = 0; j < n; j++, i++)
+			if(spsc_peek(&t->q, j) != i)
+				t->errors++;
+
+		spsc_release(&t->q, n);
+	}
+
+	complete(&t->done);
+	return 0;
+}
+
+/* 
+   hammer a ring sized handoff queue from a producer and a consumer thread
+   on different cpus and report the throughput
+*/
+static void spsc_selftest_run(unsigned int ops) {
+
+	struct task_struct *prod, *cons;
+	struct spsc_test *t;
+	unsigned int cpu;
+	ktime_t start;
+	u64 ns;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if(!t || spsc_init(&t->q, RING_DEFAULT, GFP_KERNEL, NUMA_NO_NODE)) {
+		kfree(t);
+		pr_err("spsc selftest: out of memory\n");
+		return;
+	}
+	t->ops = ops;
+	init_completion(&t->done);
+
+	prod = kthread_create(spsc_test_producer, t, "spsc_prod");
+	cons = kthread_create(spsc_test_consumer, t, "spsc_cons");
+	if(IS_ERR(prod) || IS_ERR(cons)) {
+		if(!IS_ERR(prod))
+			kthread_stop(prod);
+		if(!IS_ERR(cons))
+			kthread_stop(cons);
+		pr_err("spsc selftest: can't start threads\n");
+		goto out;
+	}
+
+	/* keep the two sides on separate cpus when there are two */
+	cpu = cpumask_first(cpu_online_mask);
+	kthread_bind(prod, cpu);
+	cpu = cpumask_next(cpu, cpu_online_mask);
+	if(cpu < nr_cpu_ids)
+		kthread_bind(cons, cpu);
+
+	start = ktime_get();
+	wake_up_process(prod);
+	wake_up_process(cons);
+
+	wait_for_completion(&t->done);
+	wait_for_completion(&t->done);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	pr_info("spsc selftest: %u ops in %llu ns, %llu ops/sec, %u errors\n",
+		ops, ns, div64_u64((u64)ops * NSEC_PER_SEC, max_t(u64, ns, 1)),
+		t->errors);
+
+out:
+	spsc_free(&t->q);
+	kfree(t);
+}
+
 /* function for insmod call */
 static int __init hello_init(void) {
 
     	int ret = 0;
+	int i;
     
     	printk(KERN_INFO "pci module loading..\n");
+
+	if(spsc_selftest)
+		spsc_selftest_run(spsc_selftest);
+
+	/* the sysfs group lists the same counters ethtool shows */
+	for(i = 0; i < HW_STATS_NUM; i++)
+		hw_stat_attrs[i] = &hw_stats[i].attr.attr;
  
-    	/* register the pci device */
-    	ret = pci_register_driver(&my_driver);
-    
-    	/* dynamic device allocation */
+    	/* dynamic device allocation, one minor per adapter */
     	ret = alloc_chrdev_region(&mydev.mydev_node, 0, DEVCNT, 
 			      	  DEV_NAME);
     	if(ret) {
@@ -542,44 +3721,39 @@ static int __init hello_init(void) {
     
     	/* create the device class /sys/class */
     	char_class = class_create(THIS_MODULE, DEV_CLASS);
-    	/* change file permissions */
-    	char_class -> devnode = my_devnode;
     	if(IS_ERR(char_class)) {
+		ret = PTR_ERR(char_class);
 		printk(KERN_ERR "problem creating device class...\n");
 		goto cdev_err;
     	}
+    	/* change file permissions */
+    	char_class -> devnode = my_devnode;
     	printk(KERN_INFO "device class registered successfully...\n");
 
     	/* allow file operations on device */
     	cdev_init(&mydev.cdev, &mydev_fops);
     	mydev.cdev.owner = THIS_MODULE;
 
-    	/* add cdev to core with device number */
-    	mydev.mydev_node = MKDEV(MAJOR(mydev.mydev_node), 
-		       	               MINOR(mydev.mydev_node));
-
-    	/* allow user to access device */
+    	/* allow user to access device, dev_open() finds the adapter by minor */
     	ret = cdev_add(&mydev.cdev, mydev.mydev_node, DEVCNT);
     	if(ret) {
-		class_unregister(char_class);
-		class_destroy(char_class);
         	printk(KERN_ERR "cdev add failed!\n");
-        	goto cdev_err;
+        	goto class_err;
     	}
 
-    	/* create the device node */
-    	if(device_create(char_class, NULL, mydev.mydev_node, NULL, 
-	             	 DEV_NAME) == NULL) {
-		class_unregister(char_class);
-		class_destroy(char_class);
-		device_destroy(char_class, mydev.mydev_node);
-		printk(KERN_ERR "failed to create device...\n");
-		goto cdev_err;
+    	/* register the pci device, probe creates a device node per adapter */
+    	ret = pci_register_driver(&my_driver);
+    	if(ret) {
+		printk(KERN_ERR "pci_register_driver failed...%d\n", ret);
+		goto pci_err;
     	}
 
-   
     	return ret;
 
+pci_err:
+    	cdev_del(&mydev.cdev);
+class_err:
+    	class_destroy(char_class);
 cdev_err:
     	unregister_chrdev_region(mydev.mydev_node, DEVCNT);
     	return ret;  
@@ -589,11 +3763,10 @@ cdev_err:
 /* function for rmmod call */
 static void __exit hello_exit(void) {
 
-    	/* unregister the pci device */
+    	/* unregister the pci device, removes every adapter's device node */
     	pci_unregister_driver(&my_driver);
  
-    	device_destroy(char_class, mydev.mydev_node);
-    	class_unregister(char_class);
+    	cdev_del(&mydev.cdev);
     	class_destroy(char_class);
     	unregister_chrdev_region(mydev.mydev_node, DEVCNT);
    
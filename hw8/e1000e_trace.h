@@ -0,0 +1,79 @@
+/* 
+   Tracepoints for the rx path
+   Homework #8
+
+   enable with:
+	echo 1 > /sys/kernel/debug/tracing/events/e1000e/enable
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM e1000e
+
+#if !defined(_E1000E_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _E1000E_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* a descriptor the hardware wrote back, before its DD bit is cleared */
+TRACE_EVENT(e1000e_rx_desc,
+
+	TP_PROTO(unsigned int index, const struct rx_desc *desc),
+
+	TP_ARGS(index, desc),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(u64,          addr)
+		__field(u16,          length)
+		__field(u16,          css)
+		__field(u8,           status)
+		__field(u8,           error)
+		__field(u16,          special)
+	),
+
+	TP_fast_assign(
+		__entry->index   = index;
+		__entry->addr    = le64_to_cpu(desc->buffer_addr);
+		__entry->length  = le16_to_cpu(desc->lower.flags.length);
+		__entry->css     = le16_to_cpu(desc->lower.flags.css);
+		__entry->status  = desc->upper.field.status;
+		__entry->error   = desc->upper.field.error;
+		__entry->special = le16_to_cpu(desc->upper.field.special);
+	),
+
+	TP_printk("R[0x%03X] addr=%016llX len=%u css=%04x status=%02x error=%02x special=%04x",
+		  __entry->index, __entry->addr, __entry->length, __entry->css,
+		  __entry->status, __entry->error, __entry->special)
+);
+
+/* one run of the budgeted rx poll */
+TRACE_EVENT(e1000e_rx_poll,
+
+	TP_PROTO(int cleaned, int budget, unsigned int next_to_clean),
+
+	TP_ARGS(cleaned, budget, next_to_clean),
+
+	TP_STRUCT__entry(
+		__field(int,          cleaned)
+		__field(int,          budget)
+		__field(unsigned int, next_to_clean)
+	),
+
+	TP_fast_assign(
+		__entry->cleaned       = cleaned;
+		__entry->budget        = budget;
+		__entry->next_to_clean = next_to_clean;
+	),
+
+	TP_printk("cleaned=%d budget=%d next_to_clean=%u",
+		  __entry->cleaned, __entry->budget, __entry->next_to_clean)
+);
+
+#endif /* _E1000E_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE e1000e_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,87 @@
+/*
+   User space interface to /dev/ece_led
+   Homework #8
+*/
+
+#ifndef ECE_LED_H
+#define ECE_LED_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+   mmap offsets, both mappings are read only
+
+   ECE_LED_MMAP_DESC  the rx descriptor ring, desc_len bytes
+   ECE_LED_MMAP_BUFS  the rx buffers, the frame for descriptor i starts at
+                      i * buf_stride + buf_offset
+
+   While either mapping exists the ring belongs to user space: the driver
+   stops recycling descriptors and user space hands them back with
+   ECE_LED_RETURN_DESC once it is done with the frames. Mapping the ring
+   and ECE_LED_RETURN_DESC need CAP_NET_RAW.
+*/
+#define ECE_LED_MMAP_DESC      0x00000000
+#define ECE_LED_MMAP_BUFS      0x00100000
+
+/* rx ring geometry */
+struct ece_led_ring_info {
+	__u32 count;       /* number of descriptors, a power of two */
+	__u32 desc_len;    /* size of the descriptor ring in bytes */
+	__u32 buf_stride;  /* distance between buffers in the buffer mapping */
+	__u32 buf_len;     /* usable bytes per buffer */
+	__u32 buf_offset;  /* where the frame starts inside its buffer */
+	__u32 next_desc;   /* next descriptor the hardware will fill */
+};
+
+/*
+   read() returns as many complete frames as fit in the buffer, each as an
+   ece_led_frame header followed by the frame (FCS included), with the next
+   header starting ECE_LED_FRAME_LEN(len) bytes after this one. It blocks
+   until at least one frame is ready unless the file is O_NONBLOCK, and
+   fails with EINVAL if the buffer can't hold the next frame, or with
+   EBUSY while the ring is mmapped.
+
+   While any file has the device open for reading, received frames are
+   held for read() instead of going to the network stack, so opening it
+   for reading needs CAP_NET_RAW; open it O_WRONLY to only transmit.
+*/
+struct ece_led_frame {
+	__u16 len;         /* frame bytes that follow the header */
+	__u8  status;      /* descriptor status bits */
+	__u8  errors;      /* descriptor error bits */
+	__u16 index;       /* rx descriptor the frame arrived in */
+	__u16 reserved;
+	__u64 tstamp;      /* CLOCK_MONOTONIC ns when the driver picked it up */
+};
+
+#define ECE_LED_FRAME_ALIGN    8
+#define ECE_LED_FRAME_LEN(len) \
+	(((sizeof(struct ece_led_frame) + (len)) + ECE_LED_FRAME_ALIGN - 1) & \
+	 ~(ECE_LED_FRAME_ALIGN - 1))
+
+/*
+   write() takes back to back frames, each led by a __u16 length in host
+   byte order, and queues them all with as few tail writes as possible.
+   The hardware appends the FCS. Needs CAP_NET_RAW.
+*/
+#define ECE_LED_TX_MIN         14
+#define ECE_LED_TX_MAX         1514
+
+#define ECE_LED_IOC_MAGIC      'E'
+
+/* read the ring geometry */
+#define ECE_LED_GET_RING_INFO  _IOR(ECE_LED_IOC_MAGIC, 1, struct ece_led_ring_info)
+
+/* hand back the given number of consumed descriptors, oldest first */
+#define ECE_LED_RETURN_DESC    _IOW(ECE_LED_IOC_MAGIC, 2, __u32)
+
+/*
+   busy poll this file: read() spins on the rx ring for up to the given
+   number of usecs, with rx interrupts masked, before it sleeps on the
+   interrupt; 0 turns it off. Only for files open for reading.
+*/
+#define ECE_LED_BUSY_POLL_MAX  100000
+#define ECE_LED_SET_BUSY_POLL  _IOW(ECE_LED_IOC_MAGIC, 3, __u32)
+
+#endif /* ECE_LED_H */
@@ -7,32 +7,64 @@
 #include <sys/stat.h>
 #include <stdint.h>
 
+#include "../ece_led.h"
+
 #define CHAR_DEVICE "/dev/ece_led"
+#define READ_LEN    65536
 
-int main()
+int main(int argc, char **argv)
 {
 
-int      fd;
-ssize_t  readb;
-uint32_t head_tail;
-uint16_t head, tail;
+int                  fd;
+ssize_t              readb;
+size_t               off;
+unsigned char        *buf;
+struct ece_led_frame *hdr;
+unsigned char        *frame;
 
-/* open device for r/w */
-fd = open(CHAR_DEVICE, O_RDWR);
-if(fd < 0)
+/* open device for reading, this takes received frames away from the stack */
+fd = open(argc > 1 ? argv[1] : CHAR_DEVICE, O_RDONLY);
+if(fd < 0) {
     printf("\nUnable to open device...\n");
+    return 1;
+}
 
-readb = read(fd, &head_tail, sizeof(uint32_t));
-if(readb < 0)
-    printf("\nUnable to read device...%ld\n", readb);
+buf = malloc(READ_LEN);
+if(!buf) {
+    close(fd);
+    return 1;
+}
+
+/* one read returns a batch of frames, each behind its header */
+readb = read(fd, buf, READ_LEN);
+if(readb < 0) {
+    printf("\nUnable to read device...%d\n", errno);
+    free(buf);
+    close(fd);
+    return 1;
+}
 
-printf("\nRead from device: 0x%08x\n", head_tail);
+printf("\nRead %ld bytes from device\n", (long)readb);
 
-head = (head_tail >> 16) & 0xFFFFFFFF;
-tail = head_tail & 0xFFFF;
+for(off = 0; off + sizeof(*hdr) <= (size_t)readb; off += ECE_LED_FRAME_LEN(hdr->len)) {
 
-printf("head = %d  tail = %d\n", head, tail);
+    hdr   = (struct ece_led_frame *)(buf + off);
+    frame = buf + off + sizeof(*hdr);
+
+    printf("desc %4u  len %4u  status 0x%02x  errors 0x%02x  ts %llu",
+           hdr->index, hdr->len, hdr->status, hdr->errors,
+           (unsigned long long)hdr->tstamp);
+
+    if(hdr->len >= 14)
+        printf("  %02x:%02x:%02x:%02x:%02x:%02x > %02x:%02x:%02x:%02x:%02x:%02x  type 0x%02x%02x",
+               frame[6], frame[7], frame[8], frame[9], frame[10], frame[11],
+               frame[0], frame[1], frame[2], frame[3], frame[4], frame[5],
+               frame[12], frame[13]);
+
+    printf("\n");
+}
 
+free(buf);
 close(fd);
 
 return 0;
@@ -0,0 +1,270 @@
+/*
+   Ping-pong latency benchmark for /dev/ece_led
+
+   Run "pingpong -r" on one host to reflect frames and "pingpong" on the
+   other to measure round trips, first with interrupts and then with the
+   client's reads busy polling; each pass prints p50/p99 in usecs and how
+   many rounds were lost, a round with no answer within TIMEOUT_MS.
+
+   usage: pingpong [-r] [-d device] [-n rounds] [-b busy_usecs]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+
+#include "../ece_led.h"
+
+#define CHAR_DEVICE "/dev/ece_led"
+#define READ_LEN    65536
+#define ETH_TYPE_HI 0x88          /* local experimental ethertype 0x88b5 */
+#define ETH_TYPE_LO 0xb5
+#define FRAME_LEN   60
+#define PING        1
+#define PONG        2
+#define TIMEOUT_MS  100           /* a round without a pong by then is lost */
+#define TIMED_OUT   -2
+
+/* what follows the ethernet header */
+struct probe {
+    uint8_t  kind;
+    uint8_t  pad[3];
+    uint32_t seq;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* send one probe as a length prefixed frame to the broadcast address */
+static int send_probe(int fd, uint8_t kind, uint32_t seq)
+{
+    unsigned char buf[sizeof(uint16_t) + FRAME_LEN];
+    uint16_t      len = FRAME_LEN;
+    struct probe  p;
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, &len, sizeof(len));
+    memset(buf + 2, 0xff, 6);
+    buf[2 + 12] = ETH_TYPE_HI;
+    buf[2 + 13] = ETH_TYPE_LO;
+
+    memset(&p, 0, sizeof(p));
+    p.kind = kind;
+    p.seq  = seq;
+    memcpy(buf + 2 + 14, &p, sizeof(p));
+
+    /* the fd is non-blocking, wait for room if the tx ring is full */
+    while(write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+        if(errno != EAGAIN || (poll(&pfd, 1, -1) < 0 && errno != EINTR))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+   read until a probe of the given kind shows up, returns its sequence
+   number, -1 on a read error or TIMED_OUT once the deadline (ns, 0 for
+   none) passes; the fd is non-blocking, so read() busy polls in the
+   driver if that is on and poll() waits for the interrupt
+*/
+static int64_t recv_probe(int fd, unsigned char *buf, uint8_t kind,
+                          uint64_t deadline)
+{
+    struct ece_led_frame *hdr;
+    struct pollfd        pfd = { .fd = fd, .events = POLLIN };
+    struct probe         p;
+    ssize_t              readb;
+    size_t               off;
+    uint64_t             now;
+    int64_t              seq = -1;
+    int                  wait_ms;
+
+    while(seq < 0) {
+
+        readb = read(fd, buf, READ_LEN);
+        if(readb < 0 && errno != EAGAIN)
+            return -1;
+
+        if(readb < 0) {
+            wait_ms = -1;
+            if(deadline) {
+                now = now_ns();
+                if(now >= deadline)
+                    return TIMED_OUT;
+                wait_ms = (int)((deadline - now + 999999) / 1000000);
+            }
+
+            if(poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        for(off = 0; off + sizeof(*hdr) <= (size_t)readb; off += ECE_LED_FRAME_LEN(hdr->len)) {
+
+            unsigned char *frame;
+
+            hdr   = (struct ece_led_frame *)(buf + off);
+            frame = buf + off + sizeof(*hdr);
+
+            if(hdr->len < 14 + sizeof(p) || frame[12] != ETH_TYPE_HI ||
+               frame[13] != ETH_TYPE_LO)
+                continue;
+
+            memcpy(&p, frame + 14, sizeof(p));
+            if(p.kind == kind)
+                seq = p.seq;
+        }
+    }
+
+    return seq;
+}
+
+/* answer every ping with a pong carrying the same sequence number */
+static int reflect(int fd, unsigned char *buf)
+{
+    int64_t seq;
+
+    printf("reflecting...\n");
+
+    for(;;) {
+        seq = recv_probe(fd, buf, PING, 0);
+        if(seq < 0 || send_probe(fd, PONG, (uint32_t)seq))
+            return 1;
+    }
+}
+
+/* one pass of rounds round trips with the given busy poll setting */
+static int measure(int fd, unsigned char *buf, unsigned int rounds,
+                   uint32_t busy, uint64_t *rtt)
+{
+    unsigned int i, got = 0, lost = 0;
+    uint64_t     start;
+    int64_t      seq;
+
+    if(ioctl(fd, ECE_LED_SET_BUSY_POLL, &busy)) {
+        printf("\nUnable to set busy poll...%d\n", errno);
+        return -1;
+    }
+
+    for(i = 0; i < rounds; i++) {
+
+        start = now_ns();
+        if(send_probe(fd, PING, i))
+            return -1;
+
+        /* stale pongs from an earlier round are skipped */
+        do {
+            seq = recv_probe(fd, buf, PONG, start + TIMEOUT_MS * 1000000ULL);
+        } while(seq >= 0 && seq != i);
+
+        /* a dropped ping or pong, go on with the next round */
+        if(seq == TIMED_OUT) {
+            lost++;
+            continue;
+        }
+
+        if(seq < 0)
+            return -1;
+
+        rtt[got++] = now_ns() - start;
+    }
+
+    if(!got) {
+        printf("%-10s busy %6u us: all %u rounds lost\n",
+               busy ? "busy poll" : "interrupt", busy, lost);
+        return 0;
+    }
+
+    qsort(rtt, got, sizeof(*rtt), cmp_u64);
+
+    printf("%-10s busy %6u us: %u rounds, p50 %.1f us, p99 %.1f us, %u lost\n",
+           busy ? "busy poll" : "interrupt", busy, got,
+           rtt[got / 2] / 1000.0, rtt[(got * 99) / 100] / 1000.0, lost);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+
+const char    *dev    = CHAR_DEVICE;
+unsigned int  rounds  = 10000;
+uint32_t      busy    = 50;
+int           reflector = 0;
+int           fd, opt, ret = 0;
+unsigned char *buf;
+uint64_t      *rtt;
+
+while((opt = getopt(argc, argv, "rd:n:b:")) != -1) {
+    switch(opt) {
+    case 'r': reflector = 1; break;
+    case 'd': dev = optarg; break;
+    case 'n': rounds = strtoul(optarg, NULL, 0); break;
+    case 'b': busy = strtoul(optarg, NULL, 0); break;
+    default:
+        printf("usage: %s [-r] [-d device] [-n rounds] [-b busy_usecs]\n", argv[0]);
+        return 1;
+    }
+}
+
+if(!rounds) {
+    printf("\nNeed at least one round\n");
+    return 1;
+}
+
+/* read and write, so received frames come here instead of the stack */
+fd = open(dev, O_RDWR | O_NONBLOCK);
+if(fd < 0) {
+    printf("\nUnable to open device...\n");
+    return 1;
+}
+
+buf = malloc(READ_LEN);
+rtt = malloc(rounds * sizeof(*rtt));
+if(!buf || !rtt) {
+    free(buf);
+    free(rtt);
+    close(fd);
+    return 1;
+}
+
+if(reflector) {
+    /* the reflector busy polls too so it adds little to the round trip */
+    if(busy && ioctl(fd, ECE_LED_SET_BUSY_POLL, &busy))
+        printf("\nUnable to set busy poll...%d\n", errno);
+    ret = reflect(fd, buf);
+} else if(measure(fd, buf, rounds, 0, rtt) || measure(fd, buf, rounds, busy, rtt)) {
+    printf("\nPing-pong failed...%d\n", errno);
+    ret = 1;
+}
+
+free(buf);
+free(rtt);
+close(fd);
+
+return ret;
+
+}